@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Measures how many errors per second a server can capture, with clients
+# raising errors concurrently.  pgbench aborts a client at its first error,
+# so each client is a psql that runs through a file of failing statements.
+#
+# Usage: bench/errors.sh [clients] [errors per client] [query bytes]
+#
+# The server is found through the usual PGHOST, PGPORT, PGDATABASE and
+# PGUSER environment variables.
+
+set -e
+
+clients=${1:-8}
+errors=${2:-20000}
+query_bytes=${3:-4096}
+
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+# A division by zero, padded with a comment so that the query text the hook
+# copies is about query_bytes long
+padding=$(head -c "$query_bytes" /dev/zero | tr '\0' 'x')
+yes "SELECT 1/0 /* $padding */;" | head -n "$errors" > "$script"
+
+start=$(date +%s%N)
+i=0
+while [ "$i" -lt "$clients" ]; do
+    psql -X -q -f "$script" > /dev/null 2>&1 &
+    i=$((i + 1))
+done
+wait
+end=$(date +%s%N)
+
+total=$((clients * errors))
+elapsed_ms=$(((end - start) / 1000000))
+echo "clients=$clients errors=$total query_bytes=$query_bytes" \
+     "elapsed_ms=$elapsed_ms errors_per_sec=$((total * 1000 / elapsed_ms))"
@@ -0,0 +1,237 @@
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_llm_helper UPDATE TO '1.1'" to load this file. \quit
+
+-- Add the new columns to the existing functions
+DROP FUNCTION get_last_error();
+CREATE FUNCTION get_last_error()
+RETURNS TABLE (
+    backend_pid int,
+    query_text text,
+    error_message text,
+    sql_state text,
+    error_level int,
+    "timestamp" timestamptz,
+    message_hash bigint,
+    queryid bigint,
+    repeat_count bigint,
+    last_seen timestamptz,
+    schema_name text,
+    table_name text,
+    column_name text,
+    constraint_name text,
+    datatype_name text
+)
+AS 'MODULE_PATHNAME', 'get_last_error'
+LANGUAGE C STRICT;
+
+DROP FUNCTION get_error_history(int);
+CREATE FUNCTION get_error_history(max_results int DEFAULT 10,
+                                  include_previous_run boolean DEFAULT false)
+RETURNS TABLE (
+    backend_pid int,
+    query_text text,
+    error_message text,
+    sql_state text,
+    error_level int,
+    "timestamp" timestamptz,
+    message_hash bigint,
+    queryid bigint,
+    repeat_count bigint,
+    last_seen timestamptz,
+    schema_name text,
+    table_name text,
+    column_name text,
+    constraint_name text,
+    datatype_name text,
+    from_previous_run boolean
+)
+AS 'MODULE_PATHNAME', 'get_error_history'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION get_errors_since(after_seq bigint, max_results int DEFAULT 1000)
+RETURNS TABLE (
+    seq bigint,
+    backend_pid int,
+    query_text text,
+    error_message text,
+    sql_state text,
+    error_level int,
+    "timestamp" timestamptz,
+    message_hash bigint,
+    queryid bigint,
+    repeat_count bigint,
+    last_seen timestamptz,
+    schema_name text,
+    table_name text,
+    column_name text,
+    constraint_name text,
+    datatype_name text,
+    lost bigint
+)
+AS 'MODULE_PATHNAME', 'get_errors_since'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION wait_for_error(after_seq bigint, timeout interval)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'wait_for_error'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION get_error_stats()
+RETURNS TABLE (
+    queryid bigint,
+    sql_state text,
+    message_hash bigint,
+    count bigint,
+    backends bigint,
+    roles bigint,
+    databases bigint,
+    first_seen timestamptz,
+    last_seen timestamptz,
+    sample_message text,
+    sample_query text
+)
+AS 'MODULE_PATHNAME', 'get_error_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_llm_error_stats AS
+    SELECT * FROM get_error_stats();
+
+CREATE FUNCTION reset_error_stats()
+RETURNS void
+AS 'MODULE_PATHNAME', 'reset_error_stats'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION get_error_class_stats()
+RETURNS TABLE (
+    sql_state_class text,
+    count bigint,
+    backends bigint,
+    roles bigint,
+    databases bigint,
+    queries bigint
+)
+AS 'MODULE_PATHNAME', 'get_error_class_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_llm_error_class_stats AS
+    SELECT * FROM get_error_class_stats();
+
+CREATE FUNCTION get_error_object_stats()
+RETURNS TABLE (
+    dbid oid,
+    schema_name text,
+    table_name text,
+    constraint_name text,
+    sql_state text,
+    count bigint,
+    first_seen timestamptz,
+    last_seen timestamptz
+)
+AS 'MODULE_PATHNAME', 'get_error_object_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_llm_error_object_stats AS
+    SELECT * FROM get_error_object_stats();
+
+-- Don't want this to be available to non-superusers.
+REVOKE ALL ON FUNCTION reset_error_stats() FROM PUBLIC;
+
+CREATE FUNCTION top_errors(k int DEFAULT 20)
+RETURNS TABLE (
+    queryid bigint,
+    sql_state text,
+    message_hash bigint,
+    estimated_count bigint,
+    sample_message text
+)
+AS 'MODULE_PATHNAME', 'top_errors'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION get_error_rate(since interval DEFAULT '1 hour')
+RETURNS TABLE (
+    minute timestamptz,
+    error_level text,
+    sql_state_class text,
+    errors bigint
+)
+AS 'MODULE_PATHNAME', 'get_error_rate'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION get_error_spikes(sigma float8 DEFAULT 3)
+RETURNS TABLE (
+    queryid bigint,
+    sql_state text,
+    message_hash bigint,
+    minute timestamptz,
+    errors bigint,
+    baseline float8,
+    stddev float8,
+    sigma float8,
+    sample_message text
+)
+AS 'MODULE_PATHNAME', 'get_error_spikes'
+LANGUAGE C STRICT VOLATILE;
+
+-- Error snapshots are server files, so these need the same privileges as
+-- COPY to or from a file; see the checks in the C code.
+CREATE FUNCTION export_error_snapshot(path text, compress boolean DEFAULT true,
+                                      node_name text DEFAULT NULL)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'export_error_snapshot'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION import_error_snapshot(path text)
+RETURNS TABLE (
+    node_name text,
+    seq bigint,
+    backend_pid int,
+    query_text text,
+    error_message text,
+    sql_state text,
+    error_level int,
+    "timestamp" timestamptz,
+    message_hash bigint,
+    queryid bigint,
+    repeat_count bigint,
+    last_seen timestamptz,
+    schema_name text,
+    table_name text,
+    column_name text,
+    constraint_name text,
+    datatype_name text
+)
+AS 'MODULE_PATHNAME', 'import_error_snapshot'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION merge_error_snapshots(paths text[], path text,
+                                      compress boolean DEFAULT true)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'merge_error_snapshots'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION export_error_snapshot(text, boolean, text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION import_error_snapshot(text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION merge_error_snapshots(text[], text, boolean) FROM PUBLIC;
+
+-- Filled in by the persist worker, see pg_llm_helper.persist_database.
+-- The worker also creates the partitions, and drops them as they expire.
+CREATE TABLE pg_llm_error_log (
+    seq bigint NOT NULL,
+    backend_pid int,
+    query_text text,
+    error_message text,
+    sql_state text,
+    error_level int,
+    "timestamp" timestamptz,
+    message_hash bigint,
+    queryid bigint,
+    repeat_count bigint,
+    last_seen timestamptz,
+    schema_name text,
+    table_name text,
+    column_name text,
+    constraint_name text,
+    datatype_name text
+) PARTITION BY RANGE ("timestamp");
+
+CREATE INDEX pg_llm_error_log_timestamp_idx ON pg_llm_error_log ("timestamp");
@@ -2,47 +2,548 @@
 #include "fmgr.h"
 #include "funcapi.h"
 #include "miscadmin.h"
+#include "pgstat.h"
+#include "access/xlog.h"
+#include "catalog/partition.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_type.h"
+#include "commands/extension.h"
+#include "common/file_utils.h"
+#include "common/hashfn.h"
+#include "common/int.h"
+#include "common/pg_lzcompress.h"
+#include "executor/spi.h"
+#include "libpq/pqformat.h"
+#include "mb/pg_wchar.h"
+#include "parser/parser.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "port/pg_crc32c.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/condition_variable.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
-#include "storage/shmem.h"
 #include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/backend_status.h"
 #include "utils/builtins.h"
+#include "utils/datetime.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/snapmgr.h"
 #include "utils/timestamp.h"
+#include "utils/wait_event.h"
 #include "tcop/tcopprot.h"
 #include "access/xact.h"
 #include "lib/stringinfo.h"
 #include "datatype/timestamp.h"
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 
 PG_MODULE_MAGIC;
 
-/* Maximum number of errors to store in circular buffer */
-#define MAX_ERRORS 100
-#define MAX_QUERY_LEN 8192
-#define MAX_ERROR_MSG_LEN 1024
+/*
+ * Value of ErrorEntry.seq.  Zero means the slot is empty; otherwise it holds
+ * the slot's ticket, shifted left by one, with the low bit set while the
+ * writer is still filling the slot in.
+ *
+ * Tickets count from 0; the sequence number shown to users is ticket + 1,
+ * so that it equals the number of errors captured up to and including it.
+ */
+#define ENTRY_SEQ(ticket) (((uint64) (ticket) + 1) << 1)
+#define ENTRY_SEQ_BUSY 1
+#define ENTRY_SEQ_TICKET(seq) (((seq) >> 1) - 1)
+#define ENTRY_SEQ_NUMBER(seq) ((seq) >> 1)
+
+/*
+ * Names of the objects an error is about, as reported by the code that
+ * raised it: schema, table, column, constraint and data type, in that
+ * order.  See error_object_names().
+ */
+#define ERROR_OBJECT_NAMES 5
+
+/* How long after an error a repeat of it still counts as right away */
+#define COALESCE_WINDOW USECS_PER_SEC
 
-/* Structure to hold error information */
+/* The longest text one error can have */
+#define ERROR_TEXT_MAX_LEN \
+    ((Size) llm_helper_max_query_length + llm_helper_max_message_length + \
+     ERROR_OBJECT_NAMES * NAMEDATALEN)
+
+/*
+ * Fixed-size header describing one error.  The error message, query text
+ * and object names are stored back to back, without terminators, in the
+ * text arena starting at text_pos; names are at most NAMEDATALEN - 1 bytes,
+ * and a length of zero means there is no such name.  dropped_seq is the
+ * highest ENTRY_SEQ of a writer that had to give up on this slot, so
+ * readers can tell its ticket will never show up.
+ *
+ * When the backend that published an entry runs into the same error again
+ * right away, it bumps repeat_count and last_seen instead of taking a new
+ * slot; see coalesce_error().  The atomic fields must stay first;
+ * publish_error copies the rest.
+ */
 typedef struct ErrorEntry
 {
+    pg_atomic_uint64 seq;
+    pg_atomic_uint64 dropped_seq;
+    pg_atomic_uint64 last_seen;     /* TimestampTz of the latest repeat */
+    pg_atomic_uint32 repeat_count;
     int32 backend_pid;
-    char query_text[MAX_QUERY_LEN];
-    char error_message[MAX_ERROR_MSG_LEN];
     char sql_state[6];
     int error_level;
+    pg_crc32c text_crc;         /* of the text, computed before copying it */
+    uint64 message_hash;        /* see error_message_hash() */
+    uint64 queryid;             /* see error_query_id() */
     TimestampTz timestamp;
+    uint64 text_pos;
+    uint32 message_len;
+    uint32 query_len;
+    uint8 name_len[ERROR_OBJECT_NAMES];
 } ErrorEntry;
 
-/* Shared memory structure */
+/*
+ * Shared memory structure
+ *
+ * Writers reserve a slot by taking a ticket from next_seq; ticket t lives in
+ * errors[t % llm_helper_max_errors].  No lock is held: concurrent writers
+ * copy into different slots in parallel, and readers validate what they
+ * copied against the slot's sequence word, retrying if it changed
+ * underneath them.
+ *
+ * Text goes to the arena, a byte ring of arena_size bytes that follows the
+ * entries and is addressed by the ever-increasing position arena_head;
+ * writers reserve space by advancing it atomically.  Bytes at position p are
+ * intact as long as arena_head has not moved past p + arena_size, except
+ * that a writer descheduled between reserving its space and copying into it
+ * can, once a full lap has gone by, write over newer text.  Each entry
+ * therefore carries a CRC of its text, which readers check too.
+ *
+ * clear_error_history() starts a new epoch by moving cleared_seq up to
+ * next_seq.  Entries with older tickets are treated as invisible; their
+ * slots and arena space are simply reused as newer errors come in.
+ *
+ * Writers broadcast on new_error_cv after publishing an entry, but only
+ * when num_waiters says someone is sleeping on it.
+ *
+ * drained_seq is the cursor of the persist worker: the sequence number of
+ * the last error it has written to pg_llm_error_log, in the sense of
+ * get_errors_since().  Only the worker moves it.  The worker ignores
+ * cleared_seq, so clearing the history doesn't keep errors out of the
+ * table; only overwritten ones are missing from it.
+ *
+ * restored_seq is the first ticket loaded from the dump file at startup,
+ * or PG_UINT64_MAX.  Entries of the previous run's ring file from there on
+ * are also in this ring, so they aren't shown twice.
+ */
 typedef struct ErrorBuffer
 {
-    LWLock *lock;
-    int current_index;
-    int total_errors;
-    ErrorEntry errors[MAX_ERRORS];
+    pg_atomic_uint64 next_seq;
+    pg_atomic_uint64 cleared_seq;   /* first ticket of the current epoch */
+    pg_atomic_uint64 arena_head;
+    pg_atomic_uint32 num_waiters;
+    pg_atomic_uint64 drained_seq;
+    uint64 restored_seq;
+    ConditionVariable new_error_cv;
+    ErrorEntry errors[FLEXIBLE_ARRAY_MEMBER];
 } ErrorBuffer;
 
+/*
+ * Per-backend state in shared memory, indexed by proc number.  last_seq is
+ * the sequence word of the backend's newest published error, or 0.
+ */
+typedef struct BackendErrorState
+{
+    pg_atomic_uint64 last_seq;
+} BackendErrorState;
+
+/*
+ * Where to find a ring and how large it is: the one errors are being
+ * captured into, or the one a previous run left in the ring file
+ */
+typedef struct ErrorRing
+{
+    ErrorBuffer *buffer;
+    char *arena;
+    Size arena_size;
+    int max_errors;
+} ErrorRing;
+
+/*
+ * Layout of the ring file: this header, then the ring, in the same layout
+ * as in shared memory, at RING_FILE_HEADER_SIZE.
+ */
+#define LLM_HELPER_RING_FILE PG_STAT_PERMANENT_DIRECTORY "/pg_llm_helper.ring"
+#define LLM_HELPER_PREVIOUS_RING_FILE LLM_HELPER_RING_FILE ".previous"
+#define LLM_HELPER_RING_MAGIC 0x4c4c4d52
+#define LLM_HELPER_RING_VERSION 2
+#define RING_FILE_HEADER_SIZE MAXALIGN(sizeof(RingFileHeader))
+
+typedef struct RingFileHeader
+{
+    uint32 magic;
+    uint32 version;
+    uint32 max_errors;
+    uint64 arena_size;
+} RingFileHeader;
+
+/* Backend-local copy of a captured error */
+typedef struct ErrorRecord
+{
+    uint64 seq;                 /* 1-based sequence number */
+    int32 backend_pid;
+    char sql_state[6];
+    int error_level;
+    uint64 message_hash;
+    uint64 queryid;
+    TimestampTz timestamp;
+    uint32 repeat_count;
+    TimestampTz last_seen;
+    char *query_text;
+    char *error_message;
+    char *object_names[ERROR_OBJECT_NAMES];    /* or NULL */
+    bool from_previous_run;
+} ErrorRecord;
+
+/*
+ * Number of columns error_record_values() fills in.  The SRFs built on it
+ * return these columns in this order, so that older versions of the SQL
+ * definitions, which lack the trailing ones, keep working.
+ */
+#define ERROR_RECORD_COLS (10 + ERROR_OBJECT_NAMES)
+
+/* Outcome of looking up one ticket in the ring */
+typedef enum TicketState
+{
+    TICKET_READ,                /* copied out */
+    TICKET_LOST,                /* overwritten or dropped, will never show up */
+    TICKET_PENDING,             /* not published yet */
+    TICKET_CLEARED              /* from before clear_error_history() */
+} TicketState;
+
+/* SQLSTATE classes counted separately; everything else is "other" */
+static const char *const sqlstate_classes[] = {
+    "03", "08", "09", "0A", "0B", "0F", "0L", "0P", "0Z", "10",
+    "20", "21", "22", "23", "24", "25", "26", "27", "28", "2B",
+    "2D", "2F", "34", "38", "39", "3B", "3D", "3F", "40", "42",
+    "44", "53", "54", "55", "57", "58", "72", "F0", "HV", "P0",
+    "XX"
+};
+
+#define SQLSTATE_CLASSES (lengthof(sqlstate_classes) + 1)
+
+/*
+ * HyperLogLog distinct-value counter small enough to embed in shared
+ * structures: 2^HLL_BITS one-byte registers, for an expected error of about
+ * 13%.  lib/hyperloglog.h allocates its registers separately, which doesn't
+ * work in shared memory.
+ */
+#define HLL_BITS 6
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+typedef struct HyperLogLog
+{
+    uint8 registers[HLL_REGISTERS];
+} HyperLogLog;
+
+/* Hashes of where an error came from, fed to the distinct counters */
+typedef struct ErrorOrigin
+{
+    uint64 pid;
+    uint64 role;
+    uint64 database;
+    uint64 queryid;
+} ErrorOrigin;
+
+/*
+ * Aggregated statistics are kept per error fingerprint: the query ID of the
+ * statement that failed, the SQLSTATE, and a hash of the untranslated message
+ * format string, so the same error with different parameters shares an
+ * entry.  Keys are hashed as blobs, so always zero them before filling in.
+ */
+typedef struct ErrorStatsKey
+{
+    uint64 queryid;
+    uint64 message_hash;
+    int sqlerrcode;
+} ErrorStatsKey;
+
+#define ERROR_STATS_SAMPLE_MESSAGE_LEN 256
+#define ERROR_STATS_SAMPLE_QUERY_LEN 1024
+
+/*
+ * Each fingerprint keeps an exponentially weighted moving average and
+ * variance of its errors per minute, as a baseline to tell spikes from its
+ * usual rate.  The weight of a minute halves about every 20 minutes, so the
+ * baseline mostly reflects the last hour.
+ */
+#define RATE_EWMA_ALPHA 0.033
+
+/*
+ * Statistics for one fingerprint.  The key and the samples, which are taken
+ * from the first occurrence, are protected by the hash table lock; the
+ * counters are updated under mutex while holding the lock in shared mode.
+ * The query ID is part of the key, so there is no counter of distinct ones.
+ *
+ * rate_count counts the errors of rate_minute.  When an error arrives in a
+ * later minute, that count and the zero counts of any minutes skipped since
+ * are folded into rate_mean and rate_var.
+ */
+typedef struct ErrorStatsEntry
+{
+    ErrorStatsKey key;          /* hash key of entry - MUST BE FIRST */
+    slock_t mutex;
+    int64 count;
+    HyperLogLog pids;
+    HyperLogLog roles;
+    HyperLogLog databases;
+    TimestampTz first_seen;
+    TimestampTz last_seen;
+    int64 rate_minute;
+    int64 rate_count;
+    double rate_mean;
+    double rate_var;
+    char sample_message[ERROR_STATS_SAMPLE_MESSAGE_LEN];
+    char sample_query[ERROR_STATS_SAMPLE_QUERY_LEN];
+} ErrorStatsEntry;
+
+/*
+ * Errors are also counted per database object they are about, to show
+ * hotspots such as a unique or foreign key constraint that keeps being
+ * violated.  Only errors that name a table or constraint are counted.
+ * Names that aren't reported are left empty.
+ */
+typedef struct ErrorObjectKey
+{
+    Oid dbid;
+    int sqlerrcode;
+    char schema_name[NAMEDATALEN];
+    char table_name[NAMEDATALEN];
+    char constraint_name[NAMEDATALEN];
+} ErrorObjectKey;
+
+/* Statistics for one object, with the same locking as ErrorStatsEntry */
+typedef struct ErrorObjectEntry
+{
+    ErrorObjectKey key;         /* hash key of entry - MUST BE FIRST */
+    slock_t mutex;
+    int64 count;
+    TimestampTz first_seen;
+    TimestampTz last_seen;
+} ErrorObjectEntry;
+
+/* Statistics for one SQLSTATE class, protected by mutex */
+typedef struct ErrorClassStats
+{
+    slock_t mutex;
+    int64 count;
+    HyperLogLog pids;
+    HyperLogLog roles;
+    HyperLogLog databases;
+    HyperLogLog queryids;
+} ErrorClassStats;
+
+/*
+ * Shared state for the statistics hash table, and the per-class statistics,
+ * which don't need a hash table
+ */
+typedef struct ErrorStatsState
+{
+    LWLock *lock;               /* protects both hash tables */
+    ErrorClassStats classes[SQLSTATE_CLASSES];
+} ErrorStatsState;
+
+/*
+ * Count-Min sketch of error fingerprints, answering "which errors are most
+ * frequent" in fixed memory however many distinct errors there are.  Each
+ * fingerprint bumps one counter per row; the smallest of them is an
+ * estimate that can only err on the high side.
+ *
+ * The sketch alone can't list its heavy hitters, so the fingerprints with
+ * the highest estimates are also kept as candidates, along with enough to
+ * tell what error they are.  Only one backend at a time maintains them,
+ * holding candidates_lock; others skip it rather than wait.  threshold is
+ * the lowest estimate among the candidates when there is no free slot, so
+ * errors that can't make it into the list don't even try.
+ */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096
+#define TOP_ERRORS_CANDIDATES 64
+
+typedef struct TopErrorCandidate
+{
+    uint64 fingerprint;
+    ErrorStatsKey key;
+    char sample_message[ERROR_STATS_SAMPLE_MESSAGE_LEN];
+} TopErrorCandidate;
+
+typedef struct ErrorSketch
+{
+    pg_atomic_flag candidates_lock;
+    pg_atomic_uint64 threshold;
+    int num_candidates;
+    TopErrorCandidate candidates[TOP_ERRORS_CANDIDATES];
+    pg_atomic_uint64 counters[SKETCH_DEPTH][SKETCH_WIDTH];
+} ErrorSketch;
+
+/*
+ * Error counts per minute over the last day, for charting error rates.
+ * Bucket m % RATE_BUCKETS counts the errors of minute m, by level (ERROR,
+ * FATAL or PANIC) and SQLSTATE class.  Its minute word works like an
+ * entry's sequence word: RATE_MINUTE(m) once it covers minute m, with the
+ * low bit set while the first writer of that minute is zeroing the counts.
+ */
+#define RATE_BUCKETS 1440
+#define RATE_LEVELS 3
+#define RATE_MINUTE(minute) (((uint64) (minute) + 1) << 1)
+#define RATE_MINUTE_CLAIMED 1
+
+typedef struct ErrorRateBucket
+{
+    pg_atomic_uint64 minute;
+    pg_atomic_uint32 counts[RATE_LEVELS][SQLSTATE_CLASSES];
+} ErrorRateBucket;
+
+/*
+ * On a clean shutdown the postmaster saves the ring and the aggregates to
+ * LLM_HELPER_DUMP_FILE, and the next startup loads them back and removes
+ * the file.  The header is followed by body_len bytes, covered by crc:
+ *
+ *   ring:     next_seq, drained_seq, cleared_seq, number of entries
+ *             (uint64 each), then per entry its ErrorEntry and text, oldest
+ *             first.  Cleared entries are included if the persist worker
+ *             hasn't saved them yet.
+ *   stats:    number of entries (uint64), then the ErrorStatsEntry structs
+ *   objects:  likewise, ErrorObjectEntry structs
+ *   classes:  ErrorClassStats[SQLSTATE_CLASSES]
+ *   sketch:   ErrorSketch
+ *   rates:    ErrorRateBucket[RATE_BUCKETS]
+ *
+ * Structs are written as they are in memory, so bump the version whenever
+ * one of them changes.
+ */
+#define LLM_HELPER_DUMP_FILE PG_STAT_PERMANENT_DIRECTORY "/pg_llm_helper.stat"
+#define LLM_HELPER_DUMP_MAGIC 0x4c4c4d48
+#define LLM_HELPER_DUMP_VERSION 3
+
+typedef struct DumpFileHeader
+{
+    uint32 magic;
+    uint32 version;
+    uint32 pg_version;          /* PG_VERSION_NUM / 100 */
+    pg_crc32c crc;
+    uint64 body_len;
+} DumpFileHeader;
+
+/* Position in the body of a dump file being loaded */
+typedef struct DumpReader
+{
+    const char *data;
+    Size len;
+    Size pos;
+} DumpReader;
+
+/*
+ * Error snapshots are files of captured errors for analysis elsewhere, see
+ * export_error_snapshot().  All integers are in network byte order.  After
+ * a header of
+ *
+ *   magic, version, flags, crc (uint32 each)
+ *   raw_len, stored_len, number of records (uint64 each)
+ *
+ * come stored_len bytes of records, which are compressed with pglz if
+ * flags has SNAPSHOT_COMPRESSED, and covered by crc as stored.  Each record
+ * is its length (uint32), then seq, backend_pid, sql_state (6 bytes),
+ * error_level, message_hash, queryid, timestamp, repeat_count and
+ * last_seen, then the node name, message, query and object names as a
+ * length (uint32, SNAPSHOT_NULL_TEXT for NULL) and bytes.  Readers skip
+ * whatever a record has beyond the fields they know.
+ */
+#define SNAPSHOT_MAGIC 0x4c4c4d53
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_COMPRESSED 0x0001
+#define SNAPSHOT_HEADER_SIZE (4 * sizeof(uint32) + 3 * sizeof(uint64))
+#define SNAPSHOT_NULL_TEXT PG_UINT32_MAX
+
+/* A captured error in a snapshot, with the node it was captured on */
+typedef struct SnapshotRecord
+{
+    char *node_name;
+    ErrorRecord error;
+} SnapshotRecord;
+
+/* A candidate in the output of top_errors() */
+typedef struct TopErrorRow
+{
+    uint64 estimate;
+    int index;
+} TopErrorRow;
+
+/* Output buffer of normalize_query() */
+typedef struct NormalizeState
+{
+    char *dst;                  /* NULL to only look for parameter symbols */
+    Size size;                  /* room in dst, not counting the terminator */
+    Size len;
+    int next_param;             /* number of the next $n to hand out */
+} NormalizeState;
+
+/* Values of pg_llm_helper.partition_by */
+typedef enum PartitionBy
+{
+    PARTITION_BY_DAY,
+    PARTITION_BY_HOUR,
+} PartitionBy;
+
+static const struct config_enum_entry partition_by_options[] = {
+    {"day", PARTITION_BY_DAY, false},
+    {"hour", PARTITION_BY_HOUR, false},
+    {NULL, 0, false}
+};
+
+/* GUC variables */
+static int llm_helper_max_errors = 8192;
+static int llm_helper_text_buffer_size = 1024;    /* in kB */
+static int llm_helper_max_query_length = 8192;
+static int llm_helper_max_message_length = 1024;
+static int llm_helper_max_stats = 1000;
+static bool llm_helper_normalize_queries = false;
+static bool llm_helper_coalesce_repeats = true;
+static bool llm_helper_save = true;
+static bool llm_helper_ring_file = false;
+static int llm_helper_partition_by = PARTITION_BY_DAY;
+static int llm_helper_retention = 7 * 24 * 60;    /* in minutes */
+static char *llm_helper_persist_database = NULL;
+static int llm_helper_persist_interval = 10000;    /* in ms */
+
 /* Global variables */
 static ErrorBuffer *error_buffer = NULL;
+static char *error_arena = NULL;
+static Size arena_size = 0;
+static BackendErrorState *backend_state = NULL;
+static ErrorRing current_ring;
+static ErrorRing previous_ring;
+static bool previous_ring_opened = false;
+static void *ring_mapping = NULL;   /* postmaster's mapping of the ring file */
+static uint32 wait_event_wait_for_error = 0;
+static uint32 wait_event_persist = 0;
+static bool is_persist_worker = false;
+static ErrorStatsState *error_stats = NULL;
+static HTAB *error_stats_hash = NULL;
+static HTAB *error_objects_hash = NULL;
+static ErrorSketch *error_sketch = NULL;
+static ErrorRateBucket *error_rates = NULL;
+static char *normalized_query = NULL;
+static ErrorEntry last_published;     /* header of our newest error */
+static uint64 last_published_seq = 0;   /* and its sequence word, or 0 */
 static emit_log_hook_type prev_emit_log_hook = NULL;
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static shmem_request_hook_type prev_shmem_request_hook = NULL;
@@ -50,22 +551,128 @@ static shmem_request_hook_type prev_shmem_request_hook = NULL;
 /* Function declarations */
 void _PG_init(void);
 void _PG_fini(void);
+PGDLLEXPORT void llm_helper_persist_main(Datum main_arg) pg_attribute_noreturn();
 
 static void llm_helper_emit_log(ErrorData *edata);
+static const char *capture_query_text(void);
+static void stage_error(ErrorData *edata, const char *query,
+                        ErrorEntry *staged);
+static void stage_error_text(ErrorData *edata, const char *query,
+                             ErrorEntry *staged);
+static bool coalesce_error(ErrorEntry *staged);
+static uint64 publish_error(ErrorEntry *staged);
+static void error_origin(ErrorEntry *staged, ErrorOrigin *origin);
+static void record_error_stats(ErrorStatsKey *key, ErrorOrigin *origin,
+                               ErrorData *edata, const char *query,
+                               ErrorEntry *staged);
+static void record_error_class(ErrorOrigin *origin, ErrorEntry *staged);
+static ErrorStatsEntry *error_stats_enter(ErrorStatsKey *key, ErrorData *edata,
+                                          const char *query, TimestampTz now);
+static void error_stats_dealloc(HTAB *htab, Size count_offset);
+static ErrorStatsEntry *copy_error_stats(int *count);
+static void record_error_object(ErrorData *edata, ErrorEntry *staged);
+static ErrorObjectEntry *copy_error_objects(int *count);
+static void hll_add(HyperLogLog *hll, uint64 hash);
+static int64 hll_estimate(const HyperLogLog *hll);
+static void rate_ewma_advance(double *mean, double *var, int64 count,
+                              int64 minutes);
+static uint64 error_fingerprint(ErrorStatsKey *key);
+static void record_error_sketch(ErrorStatsKey *key, ErrorData *edata);
+static uint64 sketch_add(uint64 fingerprint);
+static uint64 sketch_estimate(uint64 fingerprint);
+static int top_error_cmp(const void *a, const void *b);
+static void record_error_rate(ErrorEntry *staged);
+static int sqlstate_class_index(const char *sql_state);
+static int64 interval_to_usecs(Interval *interval);
+static uint64 error_message_hash(ErrorData *edata);
+static uint64 error_query_id(const char *query);
+static Size clip_text_length(const char *str, int limit);
+static void clip_text_copy(char *dst, const char *src, int size);
+static void error_object_names(ErrorData *edata,
+                               const char *names[ERROR_OBJECT_NAMES]);
+static Size normalize_query(const char *query, char *dst, Size size);
+static const char *normalize_scan(const char *p, NormalizeState *state);
+static void normalize_append(NormalizeState *state, const char *src, Size len);
+static void normalize_append_param(NormalizeState *state);
+static const char *skip_quoted(const char *p, char quote, bool backslash);
+static const char *skip_comment(const char *p);
+static const char *skip_dollar_quoted(const char *p, bool *is_quote);
+static const char *skip_number(const char *p);
 static void llm_helper_shmem_startup(void);
 static void llm_helper_shmem_request(void);
 static Size llm_helper_shmem_size(void);
+static Size llm_helper_shmem_request_size(void);
+static Size llm_helper_ring_size(int max_errors, Size arena_bytes);
+static ErrorBuffer *map_ring_file(bool create);
+static ErrorRing *open_previous_ring(void);
+static void llm_helper_shmem_shutdown(int code, Datum arg);
+static bool dump_write(FILE *file, pg_crc32c *crc, const void *data, Size len);
+static bool dump_hash(FILE *file, pg_crc32c *crc, HTAB *htab, Size entrysize);
+static void load_dump_file(void);
+static bool dump_read(DumpReader *reader, void *dest, Size len);
+static bool load_ring(DumpReader *reader);
+static bool load_hash(DumpReader *reader, HTAB *htab, Size entrysize,
+                      Size mutex_offset);
+static Size error_text_len(ErrorEntry *entry);
+static int llm_helper_num_backends(void);
+static void arena_write(uint64 pos, const char *src, Size len);
+static void arena_read(ErrorRing *ring, uint64 pos, char *dest, Size len);
+static bool read_error_entry(ErrorEntry *entry, ErrorEntry *dest);
+static bool read_error_text(ErrorRing *ring, ErrorEntry *header,
+                            ErrorRecord *dest);
+static TicketState read_ticket_header(ErrorRing *ring, uint64 ticket,
+                                      ErrorEntry *header);
+static TicketState read_slot_header(ErrorRing *ring, uint64 ticket,
+                                    ErrorEntry *header);
+static TicketState read_ticket(ErrorRing *ring, uint64 ticket,
+                               ErrorRecord *dest);
+static uint64 cursor_first_ticket(int64 after_seq, uint64 next_seq,
+                                  bool include_cleared, uint64 *lost);
+static bool error_published_since(int64 after_seq);
+static void error_record_values(ErrorRecord *record, Datum *values, bool *nulls);
+static void register_persist_worker(void);
+static Oid persist_schema(void);
+static void persist_errors(void);
+static void ensure_partition(Oid schema, const char *schema_name,
+                             TimestampTz timestamp, TimestampTz *start,
+                             TimestampTz *end);
+static bool partition_exists(const char *name, Oid schema, Oid parent);
+static void expire_partitions(void);
+static void partition_name(int64 hour, bool hourly, char *name);
+static void partition_bound(int64 hour, char *bound, Size size);
+static int64 floor_div(int64 value, int64 divisor);
+static void snapshot_check_access(const char *path, bool write);
+static void write_snapshot(const char *path, SnapshotRecord *records,
+                           int64 count, bool compress);
+static void snapshot_append_text(StringInfo buf, const char *text);
+static SnapshotRecord *read_snapshot(const char *path, int64 *count);
+static char *snapshot_get_text(StringInfo msg);
+static int snapshot_key_cmp(const void *a, const void *b);
+static int snapshot_time_cmp(const void *a, const void *b);
 
 PG_FUNCTION_INFO_V1(get_last_error);
 PG_FUNCTION_INFO_V1(get_error_history);
 PG_FUNCTION_INFO_V1(clear_error_history);
+PG_FUNCTION_INFO_V1(get_errors_since);
+PG_FUNCTION_INFO_V1(wait_for_error);
+PG_FUNCTION_INFO_V1(get_error_stats);
+PG_FUNCTION_INFO_V1(reset_error_stats);
+PG_FUNCTION_INFO_V1(top_errors);
+PG_FUNCTION_INFO_V1(get_error_rate);
+PG_FUNCTION_INFO_V1(get_error_class_stats);
+PG_FUNCTION_INFO_V1(get_error_object_stats);
+PG_FUNCTION_INFO_V1(get_error_spikes);
+PG_FUNCTION_INFO_V1(export_error_snapshot);
+PG_FUNCTION_INFO_V1(import_error_snapshot);
+PG_FUNCTION_INFO_V1(merge_error_snapshots);
 
-/* Context for get_error_history set-returning function */
+/* Context for get_error_history and get_errors_since */
 typedef struct
 {
     int next_index;
-    int limit;
-    ErrorEntry *entries;
+    int count;
+    ErrorRecord *records;
+    uint64 *lost;               /* get_errors_since only */
 } ErrorHistoryContext;
 
 /*
@@ -77,6 +684,178 @@ _PG_init(void)
     if (!process_shared_preload_libraries_in_progress)
         return;
 
+    /* Define custom GUC variables */
+    DefineCustomIntVariable("pg_llm_helper.max_errors",
+                            "Sets the maximum number of errors kept in shared memory.",
+                            NULL,
+                            &llm_helper_max_errors,
+                            8192,
+                            10,
+                            INT_MAX / 2,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_llm_helper.text_buffer_size",
+                            "Sets the amount of shared memory used for query and message text.",
+                            NULL,
+                            &llm_helper_text_buffer_size,
+                            1024,
+                            64,
+                            MAX_KILOBYTES,
+                            PGC_POSTMASTER,
+                            GUC_UNIT_KB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_llm_helper.max_query_length",
+                            "Sets the maximum length of query text stored with an error.",
+                            "Longer queries are truncated.",
+                            &llm_helper_max_query_length,
+                            8192,
+                            64,
+                            1024 * 1024,
+                            PGC_POSTMASTER,
+                            GUC_UNIT_BYTE,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_llm_helper.max_message_length",
+                            "Sets the maximum length of error message text stored with an error.",
+                            "Longer messages are truncated.",
+                            &llm_helper_max_message_length,
+                            1024,
+                            64,
+                            1024 * 1024,
+                            PGC_POSTMASTER,
+                            GUC_UNIT_BYTE,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_llm_helper.max_stats",
+                            "Sets the maximum number of error fingerprints tracked in pg_llm_error_stats.",
+                            "The least frequent fingerprints are evicted to make room for new ones.",
+                            &llm_helper_max_stats,
+                            1000,
+                            100,
+                            INT_MAX / 2,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomBoolVariable("pg_llm_helper.normalize_queries",
+                             "Replaces constants in captured query text with parameter symbols.",
+                             "Keeps literal values, which may be sensitive, out of the error history and lets identical statements be grouped.",
+                             &llm_helper_normalize_queries,
+                             false,
+                             PGC_SIGHUP,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomBoolVariable("pg_llm_helper.coalesce_repeats",
+                             "Counts an error that a backend repeats right away in the entry of its first occurrence.",
+                             "This keeps retry loops from filling the error history with copies of one error.",
+                             &llm_helper_coalesce_repeats,
+                             true,
+                             PGC_SIGHUP,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomBoolVariable("pg_llm_helper.save",
+                             "Saves captured errors and error statistics across server shutdowns.",
+                             NULL,
+                             &llm_helper_save,
+                             true,
+                             PGC_SIGHUP,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomBoolVariable("pg_llm_helper.ring_file",
+                             "Keeps the error buffer in a memory-mapped file in the data directory.",
+                             "The errors captured before a crash can then be read after the restart.",
+                             &llm_helper_ring_file,
+                             false,
+                             PGC_POSTMASTER,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomStringVariable("pg_llm_helper.persist_database",
+                               "Database in which a background worker saves captured errors to pg_llm_error_log.",
+                               "Leave empty to keep errors in shared memory only.",
+                               &llm_helper_persist_database,
+                               "",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    DefineCustomIntVariable("pg_llm_helper.persist_interval",
+                            "Sets how often the background worker saves new errors.",
+                            NULL,
+                            &llm_helper_persist_interval,
+                            10000,
+                            100,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomEnumVariable("pg_llm_helper.partition_by",
+                             "Sets the time range of each partition of pg_llm_error_log.",
+                             "Partitions cover whole UTC days or hours.",
+                             &llm_helper_partition_by,
+                             PARTITION_BY_DAY,
+                             partition_by_options,
+                             PGC_SIGHUP,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomIntVariable("pg_llm_helper.retention",
+                            "Sets how long errors are kept in pg_llm_error_log.",
+                            "Partitions are dropped once all their errors are older than this. Zero keeps them forever.",
+                            &llm_helper_retention,
+                            7 * 24 * 60,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MIN,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    MarkGUCPrefixReserved("pg_llm_helper");
+
+    /*
+     * Scratch space for normalized query text.  The hook must not allocate,
+     * so set it aside now; backends inherit it from the postmaster.
+     */
+    normalized_query = MemoryContextAlloc(TopMemoryContext,
+                                          llm_helper_max_query_length);
+
+    /* The arena must at least fit the longest possible error */
+    arena_size = MAXALIGN(Max((Size) llm_helper_text_buffer_size * 1024,
+                              ERROR_TEXT_MAX_LEN));
+
     /* Install hooks */
     prev_shmem_request_hook = shmem_request_hook;
     shmem_request_hook = llm_helper_shmem_request;
@@ -87,6 +866,9 @@ _PG_init(void)
     prev_emit_log_hook = emit_log_hook;
     emit_log_hook = llm_helper_emit_log;
 
+    if (llm_helper_persist_database[0] != '\0')
+        register_persist_worker();
+
     elog(LOG, "pg_llm_helper loaded");
 }
 
@@ -111,19 +893,64 @@ llm_helper_shmem_request(void)
     if (prev_shmem_request_hook)
         prev_shmem_request_hook();
 
-    RequestAddinShmemSpace(llm_helper_shmem_size());
+    RequestAddinShmemSpace(llm_helper_shmem_request_size());
     RequestNamedLWLockTranche("pg_llm_helper", 1);
 }
 
 /*
- * Calculate shared memory size needed
+ * Number of BackendErrorState slots: one per proc number, auxiliary
+ * processes included
+ */
+static int
+llm_helper_num_backends(void)
+{
+    return MaxBackends + NUM_AUXILIARY_PROCS;
+}
+
+/*
+ * Size of a ring with its arena
+ */
+static Size
+llm_helper_ring_size(int max_errors, Size arena_bytes)
+{
+    return add_size(MAXALIGN(offsetof(ErrorBuffer, errors) +
+                             mul_size(max_errors, sizeof(ErrorEntry))),
+                    arena_bytes);
+}
+
+/*
+ * Calculate shared memory size needed.  The main struct holds the
+ * per-backend state, preceded by the ring unless that lives in the ring
+ * file.
  */
 static Size
 llm_helper_shmem_size(void)
 {
-    Size size;
+    Size size = 0;
+
+    if (!llm_helper_ring_file)
+        size = llm_helper_ring_size(llm_helper_max_errors, arena_size);
+    size = add_size(size, MAXALIGN(mul_size(llm_helper_num_backends(),
+                                            sizeof(BackendErrorState))));
+    return size;
+}
+
+/*
+ * Calculate the total shared memory size to request
+ */
+static Size
+llm_helper_shmem_request_size(void)
+{
+    Size size = llm_helper_shmem_size();
 
-    size = MAXALIGN(sizeof(ErrorBuffer));
+    size = add_size(size, MAXALIGN(sizeof(ErrorStatsState)));
+    size = add_size(size, hash_estimate_size(llm_helper_max_stats,
+                                             sizeof(ErrorStatsEntry)));
+    size = add_size(size, hash_estimate_size(llm_helper_max_stats,
+                                             sizeof(ErrorObjectEntry)));
+    size = add_size(size, MAXALIGN(sizeof(ErrorSketch)));
+    size = add_size(size, MAXALIGN(mul_size(RATE_BUCKETS,
+                                            sizeof(ErrorRateBucket))));
     return size;
 }
 
@@ -134,238 +961,4043 @@ static void
 llm_helper_shmem_startup(void)
 {
     bool found;
+    bool created;
+    HASHCTL info;
 
     if (prev_shmem_startup_hook)
         prev_shmem_startup_hook();
 
     /* Reset in case this is a restart */
     error_buffer = NULL;
+    error_arena = NULL;
+    backend_state = NULL;
+    error_stats = NULL;
+    error_stats_hash = NULL;
+    error_objects_hash = NULL;
+    error_sketch = NULL;
+    error_rates = NULL;
 
     /* Create or attach to shared memory */
     LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 
-    error_buffer = ShmemInitStruct("pg_llm_helper",
-                                   llm_helper_shmem_size(),
-                                   &found);
+    if (llm_helper_ring_file)
+    {
+        backend_state = ShmemInitStruct("pg_llm_helper",
+                                        llm_helper_shmem_size(),
+                                        &found);
+        error_buffer = map_ring_file(!found);
+    }
+    else
+    {
+        error_buffer = ShmemInitStruct("pg_llm_helper",
+                                       llm_helper_shmem_size(),
+                                       &found);
+
+        /* Ring files from when ring_file was on are stale now */
+        if (!found)
+        {
+            (void) unlink(LLM_HELPER_RING_FILE);
+            (void) unlink(LLM_HELPER_PREVIOUS_RING_FILE);
+        }
+        backend_state = (BackendErrorState *)
+            ((char *) error_buffer +
+             llm_helper_ring_size(llm_helper_max_errors, arena_size));
+    }
+    error_arena = (char *) error_buffer +
+        MAXALIGN(offsetof(ErrorBuffer, errors) +
+                 llm_helper_max_errors * sizeof(ErrorEntry));
+    created = !found;
+
+    current_ring.buffer = error_buffer;
+    current_ring.arena = error_arena;
+    current_ring.arena_size = arena_size;
+    current_ring.max_errors = llm_helper_max_errors;
 
     if (!found)
     {
+        int i;
+
         /* Initialize shared memory */
-        error_buffer->lock = &(GetNamedLWLockTranche("pg_llm_helper"))->lock;
-        error_buffer->current_index = 0;
-        error_buffer->total_errors = 0;
-        memset(error_buffer->errors, 0, sizeof(error_buffer->errors));
+        pg_atomic_init_u64(&error_buffer->next_seq, 0);
+        pg_atomic_init_u64(&error_buffer->cleared_seq, 0);
+        pg_atomic_init_u64(&error_buffer->arena_head, 0);
+        pg_atomic_init_u32(&error_buffer->num_waiters, 0);
+        pg_atomic_init_u64(&error_buffer->drained_seq, 0);
+        error_buffer->restored_seq = PG_UINT64_MAX;
+        ConditionVariableInit(&error_buffer->new_error_cv);
+        memset(error_buffer->errors, 0,
+               llm_helper_max_errors * sizeof(ErrorEntry));
+        for (i = 0; i < llm_helper_max_errors; i++)
+        {
+            pg_atomic_init_u64(&error_buffer->errors[i].seq, 0);
+            pg_atomic_init_u64(&error_buffer->errors[i].dropped_seq, 0);
+            pg_atomic_init_u64(&error_buffer->errors[i].last_seen, 0);
+            pg_atomic_init_u32(&error_buffer->errors[i].repeat_count, 0);
+        }
+        for (i = 0; i < llm_helper_num_backends(); i++)
+            pg_atomic_init_u64(&backend_state[i].last_seq, 0);
+    }
+
+    error_stats = ShmemInitStruct("pg_llm_helper stats",
+                                  sizeof(ErrorStatsState),
+                                  &found);
+    if (!found)
+    {
+        int i;
+
+        error_stats->lock = &(GetNamedLWLockTranche("pg_llm_helper"))->lock;
+        memset(error_stats->classes, 0, sizeof(error_stats->classes));
+        for (i = 0; i < SQLSTATE_CLASSES; i++)
+            SpinLockInit(&error_stats->classes[i].mutex);
+    }
+
+    info.keysize = sizeof(ErrorStatsKey);
+    info.entrysize = sizeof(ErrorStatsEntry);
+    error_stats_hash = ShmemInitHash("pg_llm_helper hash",
+                                     llm_helper_max_stats,
+                                     llm_helper_max_stats,
+                                     &info,
+                                     HASH_ELEM | HASH_BLOBS);
+
+    info.keysize = sizeof(ErrorObjectKey);
+    info.entrysize = sizeof(ErrorObjectEntry);
+    error_objects_hash = ShmemInitHash("pg_llm_helper object hash",
+                                       llm_helper_max_stats,
+                                       llm_helper_max_stats,
+                                       &info,
+                                       HASH_ELEM | HASH_BLOBS);
+
+    error_sketch = ShmemInitStruct("pg_llm_helper sketch",
+                                   sizeof(ErrorSketch),
+                                   &found);
+    if (!found)
+    {
+        int i;
+        int j;
+
+        pg_atomic_init_flag(&error_sketch->candidates_lock);
+        pg_atomic_init_u64(&error_sketch->threshold, 0);
+        error_sketch->num_candidates = 0;
+        for (i = 0; i < SKETCH_DEPTH; i++)
+            for (j = 0; j < SKETCH_WIDTH; j++)
+                pg_atomic_init_u64(&error_sketch->counters[i][j], 0);
+    }
+
+    error_rates = ShmemInitStruct("pg_llm_helper rates",
+                                  RATE_BUCKETS * sizeof(ErrorRateBucket),
+                                  &found);
+    if (!found)
+    {
+        int i;
+        int j;
+        int k;
+
+        for (i = 0; i < RATE_BUCKETS; i++)
+        {
+            pg_atomic_init_u64(&error_rates[i].minute, 0);
+            for (j = 0; j < RATE_LEVELS; j++)
+                for (k = 0; k < SQLSTATE_CLASSES; k++)
+                    pg_atomic_init_u32(&error_rates[i].counts[j][k], 0);
+        }
     }
 
+    /*
+     * The postmaster saves everything at shutdown, and loads it back when
+     * it creates shared memory.  No other process is running at either
+     * point, so there's no locking to do.
+     */
+    if (!IsUnderPostmaster)
+        on_shmem_exit(llm_helper_shmem_shutdown, (Datum) 0);
+    if (created)
+        load_dump_file();
+
     LWLockRelease(AddinShmemInitLock);
 }
 
 /*
- * Hook to capture log messages and errors
+ * Map the ring file, in which the ring lives when ring_file is on.  The
+ * postmaster creates a new one each time it sets up shared memory, keeping
+ * the old one for open_previous_ring(); after a crash that holds the errors
+ * that led up to it.  Backends inherit the mapping, except in EXEC_BACKEND
+ * builds, which attach to the existing file.
+ *
+ * The file is written out in full up front, so that running out of disk
+ * space shows up here and not as SIGBUS in whichever process writes an
+ * error.
  */
-static void
-llm_helper_emit_log(ErrorData *edata)
+static ErrorBuffer *
+map_ring_file(bool create)
 {
-    /* Only capture errors and warnings */
-    if (edata->elevel >= ERROR && error_buffer != NULL)
-    {
-        ErrorEntry *entry;
-        const char *query;
+    Size size = RING_FILE_HEADER_SIZE +
+        llm_helper_ring_size(llm_helper_max_errors, arena_size);
+    RingFileHeader header;
+    char *mapping;
+    int fd;
 
-        LWLockAcquire(error_buffer->lock, LW_EXCLUSIVE);
-
-        /* Get next slot in circular buffer */
-        entry = &error_buffer->errors[error_buffer->current_index];
-        error_buffer->current_index = (error_buffer->current_index + 1) % MAX_ERRORS;
-        error_buffer->total_errors++;
-
-        /* Store error information */
-        entry->backend_pid = MyProcPid;
-        entry->error_level = edata->elevel;
-        entry->timestamp = GetCurrentTimestamp();
-
-        /* Copy SQL state */
-        if (edata->sqlerrcode)
-            snprintf(entry->sql_state, sizeof(entry->sql_state), 
-                    "%s", unpack_sql_state(edata->sqlerrcode));
-        else
-            entry->sql_state[0] = '\0';
+    if (create)
+    {
+        /* After a crash, the postmaster still has the old file mapped */
+        if (ring_mapping != NULL)
+        {
+            munmap(ring_mapping, size);
+            ring_mapping = NULL;
+        }
 
-        /* Copy error message */
-        if (edata->message)
-            strlcpy(entry->error_message, edata->message, MAX_ERROR_MSG_LEN);
-        else
-            entry->error_message[0] = '\0';
+        if (rename(LLM_HELPER_RING_FILE, LLM_HELPER_PREVIOUS_RING_FILE) != 0 &&
+            errno != ENOENT)
+            ereport(LOG,
+                    (errcode_for_file_access(),
+                     errmsg("could not rename file \"%s\" to \"%s\": %m",
+                            LLM_HELPER_RING_FILE, LLM_HELPER_PREVIOUS_RING_FILE)));
 
-        /* Copy query text */
-        query = debug_query_string ? debug_query_string : "";
-        strlcpy(entry->query_text, query, MAX_QUERY_LEN);
+        fd = OpenTransientFile(LLM_HELPER_RING_FILE,
+                               O_RDWR | O_CREAT | O_TRUNC | PG_BINARY);
+        if (fd < 0)
+            ereport(FATAL,
+                    (errcode_for_file_access(),
+                     errmsg("could not create file \"%s\": %m",
+                            LLM_HELPER_RING_FILE)));
 
-        LWLockRelease(error_buffer->lock);
+        memset(&header, 0, sizeof(header));
+        header.magic = LLM_HELPER_RING_MAGIC;
+        header.version = LLM_HELPER_RING_VERSION;
+        header.max_errors = llm_helper_max_errors;
+        header.arena_size = arena_size;
+        if (pg_pwrite_zeros(fd, size, 0) != (ssize_t) size ||
+            pg_pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header))
+            ereport(FATAL,
+                    (errcode_for_file_access(),
+                     errmsg("could not write file \"%s\": %m",
+                            LLM_HELPER_RING_FILE)));
+    }
+    else
+    {
+        fd = OpenTransientFile(LLM_HELPER_RING_FILE, O_RDWR | PG_BINARY);
+        if (fd < 0)
+            ereport(FATAL,
+                    (errcode_for_file_access(),
+                     errmsg("could not open file \"%s\": %m",
+                            LLM_HELPER_RING_FILE)));
     }
 
-    /* Call previous hook if exists */
-    if (prev_emit_log_hook)
-        prev_emit_log_hook(edata);
+    mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+        ereport(FATAL,
+                (errcode_for_file_access(),
+                 errmsg("could not map file \"%s\": %m",
+                        LLM_HELPER_RING_FILE)));
+    CloseTransientFile(fd);
+
+    ring_mapping = mapping;
+    return (ErrorBuffer *) (mapping + RING_FILE_HEADER_SIZE);
 }
 
 /*
- * SQL function: get_last_error()
- * Returns the most recent error for the current backend
+ * The ring the previous run left in the ring file, or NULL if there is
+ * none or ring_file is off.  It is mapped privately, so nothing we do
+ * changes the file, and kept mapped for the rest of the session; the file
+ * doesn't change until the next restart.
  */
-Datum
-get_last_error(PG_FUNCTION_ARGS)
+static ErrorRing *
+open_previous_ring(void)
 {
-    TupleDesc tupdesc;
-    Datum values[6];
-    bool nulls[6];
-    HeapTuple tuple;
-    int i;
-    int my_pid = MyProcPid;
-    ErrorEntry *latest = NULL;
-    TimestampTz latest_time = 0;
-
-    if (error_buffer == NULL)
-        ereport(ERROR,
-                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-                 errmsg("pg_llm_helper shared memory not initialized")));
+    struct stat st;
+    RingFileHeader header;
+    char *mapping;
+    int fd;
 
-    /* Build tuple descriptor */
-    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-        ereport(ERROR,
-                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                 errmsg("function returning record called in context that cannot accept type record")));
+    if (previous_ring_opened)
+        return previous_ring.buffer != NULL ? &previous_ring : NULL;
+    previous_ring_opened = true;
 
-    LWLockAcquire(error_buffer->lock, LW_SHARED);
+    /* A file left from when ring_file was last on isn't the previous run */
+    if (!llm_helper_ring_file)
+        return NULL;
 
-    /* Find most recent error for this backend */
-    for (i = 0; i < MAX_ERRORS; i++)
+    fd = OpenTransientFile(LLM_HELPER_PREVIOUS_RING_FILE, O_RDONLY | PG_BINARY);
+    if (fd < 0)
     {
-        ErrorEntry *entry = &error_buffer->errors[i];
-        
-        if (entry->backend_pid == my_pid && 
-            entry->timestamp > 0 &&
-            entry->timestamp > latest_time)
-        {
-            latest = entry;
-            latest_time = entry->timestamp;
-        }
+        if (errno != ENOENT)
+            ereport(WARNING,
+                    (errcode_for_file_access(),
+                     errmsg("could not open file \"%s\": %m",
+                            LLM_HELPER_PREVIOUS_RING_FILE)));
+        return NULL;
     }
 
-    if (latest == NULL)
+    if (fstat(fd, &st) != 0 ||
+        st.st_size < RING_FILE_HEADER_SIZE ||
+        pg_pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header))
     {
-        LWLockRelease(error_buffer->lock);
-        PG_RETURN_NULL();
+        CloseTransientFile(fd);
+        return NULL;
     }
 
-    /* Build result tuple */
-    memset(nulls, 0, sizeof(nulls));
-    values[0] = Int32GetDatum(latest->backend_pid);
-    values[1] = CStringGetTextDatum(latest->query_text);
-    values[2] = CStringGetTextDatum(latest->error_message);
-    values[3] = CStringGetTextDatum(latest->sql_state);
-    values[4] = Int32GetDatum(latest->error_level);
-    values[5] = TimestampTzGetDatum(latest->timestamp);
+    if (header.magic != LLM_HELPER_RING_MAGIC ||
+        header.version != LLM_HELPER_RING_VERSION ||
+        header.max_errors == 0 || header.arena_size == 0 ||
+        (Size) st.st_size < RING_FILE_HEADER_SIZE +
+        llm_helper_ring_size(header.max_errors, header.arena_size))
+    {
+        ereport(WARNING,
+                (errmsg("ignoring file \"%s\" from a different version of pg_llm_helper",
+                        LLM_HELPER_PREVIOUS_RING_FILE)));
+        CloseTransientFile(fd);
+        return NULL;
+    }
 
-    LWLockRelease(error_buffer->lock);
+    /* Writable, as atomics may be emulated with a lock even for reads */
+    mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    CloseTransientFile(fd);
+    if (mapping == MAP_FAILED)
+    {
+        ereport(WARNING,
+                (errcode_for_file_access(),
+                 errmsg("could not map file \"%s\": %m",
+                        LLM_HELPER_PREVIOUS_RING_FILE)));
+        return NULL;
+    }
 
-    tuple = heap_form_tuple(tupdesc, values, nulls);
-    PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+    previous_ring.buffer = (ErrorBuffer *) (mapping + RING_FILE_HEADER_SIZE);
+    previous_ring.arena = (char *) previous_ring.buffer +
+        MAXALIGN(offsetof(ErrorBuffer, errors) +
+                 header.max_errors * sizeof(ErrorEntry));
+    previous_ring.arena_size = header.arena_size;
+    previous_ring.max_errors = header.max_errors;
+    return &previous_ring;
 }
 
 /*
- * SQL function: get_error_history(max_results int)
- * Returns recent errors across all backends
+ * shmem_shutdown hook: save the ring and the aggregates to the dump file,
+ * in one pass.  The header, with the checksum, is filled in last.
  */
-Datum
-get_error_history(PG_FUNCTION_ARGS)
+static void
+llm_helper_shmem_shutdown(int code, Datum arg)
 {
-    FuncCallContext *funcctx;
-    int32 limit;
-    MemoryContext oldcontext;
-    ErrorHistoryContext *ctx;
-    TupleDesc tupdesc;
+    FILE *file;
+    DumpFileHeader header;
+    pg_crc32c crc;
+    uint64 next_seq;
+    uint64 drained_seq;
+    uint64 cleared_seq;
+    uint64 first;
+    uint64 lost;
+    uint64 count = 0;
+    uint64 ticket;
+    long body_start;
+    long body_end;
+    char *text;
 
-    if (SRF_IS_FIRSTCALL())
-    {
-        funcctx = SRF_FIRSTCALL_INIT();
-        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+    /* Don't save anything after a crash */
+    if (code)
+        return;
 
-        limit = PG_GETARG_INT32(0);
-        if (limit <= 0 || limit > MAX_ERRORS)
-            limit = MAX_ERRORS;
+    if (!llm_helper_save || error_buffer == NULL || error_stats_hash == NULL)
+        return;
 
-        ctx = palloc(sizeof(ErrorHistoryContext));
-        ctx->limit = limit;
-        ctx->next_index = 0;
-        ctx->entries = palloc(sizeof(ErrorEntry) * MAX_ERRORS);
+    file = AllocateFile(LLM_HELPER_DUMP_FILE ".tmp", PG_BINARY_W);
+    if (file == NULL)
+        goto error;
 
-        /* Copy entries from shared memory */
-        LWLockAcquire(error_buffer->lock, LW_SHARED);
-        memcpy(ctx->entries, error_buffer->errors, sizeof(ErrorEntry) * MAX_ERRORS);
-        LWLockRelease(error_buffer->lock);
+    memset(&header, 0, sizeof(header));
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+        goto error;
+    body_start = ftell(file);
+    INIT_CRC32C(crc);
 
-        funcctx->user_fctx = ctx;
+    /*
+     * The ring: the entries of the last lap that are either visible or not
+     * saved by the persist worker yet
+     */
+    next_seq = pg_atomic_read_u64(&error_buffer->next_seq);
+    drained_seq = pg_atomic_read_u64(&error_buffer->drained_seq);
+    cleared_seq = pg_atomic_read_u64(&error_buffer->cleared_seq);
+    first = cursor_first_ticket((int64) Min(drained_seq, cleared_seq),
+                                next_seq, true, &lost);
+    for (ticket = first; ticket < next_seq; ticket++)
+    {
+        ErrorEntry entry;
 
-        /* Build tuple descriptor */
-        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-            ereport(ERROR,
-                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                     errmsg("function returning record called in context that cannot accept type record")));
-        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        if (read_slot_header(&current_ring, ticket, &entry) == TICKET_READ &&
+            pg_atomic_read_u64(&error_buffer->arena_head) <= entry.text_pos + arena_size)
+            count++;
+    }
+    if (!dump_write(file, &crc, &next_seq, sizeof(uint64)) ||
+        !dump_write(file, &crc, &drained_seq, sizeof(uint64)) ||
+        !dump_write(file, &crc, &cleared_seq, sizeof(uint64)) ||
+        !dump_write(file, &crc, &count, sizeof(uint64)))
+        goto error;
 
-        MemoryContextSwitchTo(oldcontext);
+    /* The arena can be larger than palloc allows, so go entry by entry */
+    text = palloc(ERROR_TEXT_MAX_LEN);
+    for (ticket = first; ticket < next_seq; ticket++)
+    {
+        ErrorEntry entry;
+        Size len;
+
+        if (read_slot_header(&current_ring, ticket, &entry) != TICKET_READ ||
+            pg_atomic_read_u64(&error_buffer->arena_head) > entry.text_pos + arena_size)
+            continue;
+
+        len = error_text_len(&entry);
+        arena_read(&current_ring, entry.text_pos, text, len);
+        if (!dump_write(file, &crc, &entry, sizeof(ErrorEntry)) ||
+            !dump_write(file, &crc, text, len))
+            goto error;
     }
+    pfree(text);
 
-    funcctx = SRF_PERCALL_SETUP();
-    ctx = (ErrorHistoryContext *) funcctx->user_fctx;
+    /* The aggregates */
+    if (!dump_hash(file, &crc, error_stats_hash, sizeof(ErrorStatsEntry)) ||
+        !dump_hash(file, &crc, error_objects_hash, sizeof(ErrorObjectEntry)) ||
+        !dump_write(file, &crc, error_stats->classes,
+                    sizeof(error_stats->classes)) ||
+        !dump_write(file, &crc, error_sketch, sizeof(ErrorSketch)) ||
+        !dump_write(file, &crc, error_rates,
+                    RATE_BUCKETS * sizeof(ErrorRateBucket)))
+        goto error;
 
-    /* Find next valid entry */
-    while (ctx->next_index < MAX_ERRORS && funcctx->call_cntr < ctx->limit)
-    {
-        ErrorEntry *entry = &ctx->entries[ctx->next_index++];
-        
-        if (entry->timestamp > 0)
-        {
-            Datum values[6];
-            bool nulls[6];
-            HeapTuple tuple;
+    body_end = ftell(file);
+    if (body_start < 0 || body_end < 0)
+        goto error;
+    FIN_CRC32C(crc);
 
-            memset(nulls, 0, sizeof(nulls));
-            values[0] = Int32GetDatum(entry->backend_pid);
-            values[1] = CStringGetTextDatum(entry->query_text);
-            values[2] = CStringGetTextDatum(entry->error_message);
-            values[3] = CStringGetTextDatum(entry->sql_state);
-            values[4] = Int32GetDatum(entry->error_level);
-            values[5] = TimestampTzGetDatum(entry->timestamp);
+    header.magic = LLM_HELPER_DUMP_MAGIC;
+    header.version = LLM_HELPER_DUMP_VERSION;
+    header.pg_version = PG_VERSION_NUM / 100;
+    header.crc = crc;
+    header.body_len = body_end - body_start;
+    if (fseek(file, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, file) != 1)
+        goto error;
 
-            tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
-            SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
-        }
+    if (FreeFile(file))
+    {
+        file = NULL;
+        goto error;
     }
 
-    SRF_RETURN_DONE(funcctx);
+    (void) durable_rename(LLM_HELPER_DUMP_FILE ".tmp", LLM_HELPER_DUMP_FILE, LOG);
+    return;
+
+error:
+    ereport(LOG,
+            (errcode_for_file_access(),
+             errmsg("could not write file \"%s\": %m",
+                    LLM_HELPER_DUMP_FILE ".tmp")));
+    if (file)
+        FreeFile(file);
+    unlink(LLM_HELPER_DUMP_FILE ".tmp");
 }
 
 /*
- * SQL function: clear_error_history()
+ * Write part of the dump file body, adding it to the checksum
+ */
+static bool
+dump_write(FILE *file, pg_crc32c *crc, const void *data, Size len)
+{
+    if (len == 0)
+        return true;
+
+    COMP_CRC32C(*crc, data, len);
+    return fwrite(data, len, 1, file) == 1;
+}
+
+/*
+ * Write the number of entries in one of the statistics hash tables, then
+ * the entries
+ */
+static bool
+dump_hash(FILE *file, pg_crc32c *crc, HTAB *htab, Size entrysize)
+{
+    HASH_SEQ_STATUS hash_seq;
+    void *entry;
+    uint64 count = hash_get_num_entries(htab);
+
+    if (!dump_write(file, crc, &count, sizeof(uint64)))
+        return false;
+
+    hash_seq_init(&hash_seq, htab);
+    while ((entry = hash_seq_search(&hash_seq)) != NULL)
+    {
+        if (!dump_write(file, crc, entry, entrysize))
+        {
+            hash_seq_term(&hash_seq);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Load what the last clean shutdown saved, if anything, and remove the file
+ * so that a crash later on doesn't bring back stale data.  A file that
+ * doesn't check out is skipped as a whole, before anything is loaded from
+ * it.
+ */
+static void
+load_dump_file(void)
+{
+    FILE *file;
+    struct stat st;
+    DumpFileHeader header;
+    DumpReader reader;
+    char *body = NULL;
+    pg_crc32c crc;
+    bool loaded;
+
+    file = AllocateFile(LLM_HELPER_DUMP_FILE, PG_BINARY_R);
+    if (file == NULL)
+    {
+        if (errno != ENOENT)
+            ereport(LOG,
+                    (errcode_for_file_access(),
+                     errmsg("could not read file \"%s\": %m",
+                            LLM_HELPER_DUMP_FILE)));
+        return;
+    }
+
+    if (fstat(fileno(file), &st) != 0 ||
+        fread(&header, sizeof(header), 1, file) != 1)
+    {
+        ereport(LOG,
+                (errcode_for_file_access(),
+                 errmsg("could not read file \"%s\": %m",
+                        LLM_HELPER_DUMP_FILE)));
+        goto done;
+    }
+
+    if (header.magic != LLM_HELPER_DUMP_MAGIC ||
+        header.version != LLM_HELPER_DUMP_VERSION ||
+        header.pg_version != PG_VERSION_NUM / 100 ||
+        header.body_len != (uint64) st.st_size - sizeof(header))
+    {
+        ereport(LOG,
+                (errmsg("ignoring file \"%s\" from a different version of pg_llm_helper",
+                        LLM_HELPER_DUMP_FILE)));
+        goto done;
+    }
+
+    body = palloc_extended(header.body_len, MCXT_ALLOC_HUGE);
+    if (fread(body, header.body_len, 1, file) != 1)
+    {
+        ereport(LOG,
+                (errcode_for_file_access(),
+                 errmsg("could not read file \"%s\": %m",
+                        LLM_HELPER_DUMP_FILE)));
+        goto done;
+    }
+
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, body, header.body_len);
+    FIN_CRC32C(crc);
+    if (!EQ_CRC32C(crc, header.crc))
+    {
+        ereport(LOG,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("ignoring file \"%s\" with a checksum mismatch",
+                        LLM_HELPER_DUMP_FILE)));
+        goto done;
+    }
+
+    reader.data = body;
+    reader.len = header.body_len;
+    reader.pos = 0;
+    loaded = load_ring(&reader) &&
+        load_hash(&reader, error_stats_hash, sizeof(ErrorStatsEntry),
+                  offsetof(ErrorStatsEntry, mutex)) &&
+        load_hash(&reader, error_objects_hash, sizeof(ErrorObjectEntry),
+                  offsetof(ErrorObjectEntry, mutex)) &&
+        dump_read(&reader, error_stats->classes,
+                  sizeof(error_stats->classes)) &&
+        dump_read(&reader, error_sketch, sizeof(ErrorSketch)) &&
+        dump_read(&reader, error_rates,
+                  RATE_BUCKETS * sizeof(ErrorRateBucket));
+
+    /* Locks are never saved in a locked state, but reset them anyway */
+    if (loaded)
+    {
+        int i;
+
+        for (i = 0; i < SQLSTATE_CLASSES; i++)
+            SpinLockInit(&error_stats->classes[i].mutex);
+        pg_atomic_init_flag(&error_sketch->candidates_lock);
+    }
+    else
+        ereport(LOG,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("file \"%s\" is truncated, some errors were not loaded",
+                        LLM_HELPER_DUMP_FILE)));
+
+done:
+    if (body)
+        pfree(body);
+    FreeFile(file);
+    unlink(LLM_HELPER_DUMP_FILE);
+}
+
+/*
+ * Copy the next len bytes of a dump file body
+ */
+static bool
+dump_read(DumpReader *reader, void *dest, Size len)
+{
+    if (reader->len - reader->pos < len)
+        return false;
+
+    memcpy(dest, reader->data + reader->pos, len);
+    reader->pos += len;
+    return true;
+}
+
+/*
+ * Put the saved entries back into the ring, at their old tickets so that
+ * sequence numbers carry on where they left off.  If max_errors has been
+ * lowered, only the newest ones fit.  Tickets without an entry, such as
+ * those whose text had been overwritten, are marked as dropped from where
+ * the persist worker left off, so it counts them as lost.
+ */
+static bool
+load_ring(DumpReader *reader)
+{
+    uint64 next_seq;
+    uint64 drained_seq;
+    uint64 cleared_seq;
+    uint64 count;
+    uint64 oldest;
+    uint64 expected;
+    bool started = false;
+    uint64 ticket;
+    uint64 i;
+
+    if (!dump_read(reader, &next_seq, sizeof(uint64)) ||
+        !dump_read(reader, &drained_seq, sizeof(uint64)) ||
+        !dump_read(reader, &cleared_seq, sizeof(uint64)) ||
+        !dump_read(reader, &count, sizeof(uint64)))
+        return false;
+
+    oldest = next_seq > (uint64) llm_helper_max_errors ?
+        next_seq - llm_helper_max_errors : 0;
+    expected = Min(Max(drained_seq, oldest), next_seq);
+
+    pg_atomic_write_u64(&error_buffer->next_seq, next_seq);
+    pg_atomic_write_u64(&error_buffer->drained_seq, drained_seq);
+
+    for (i = 0; i < count; i++)
+    {
+        ErrorEntry saved;
+        ErrorEntry *entry;
+        const char *text;
+        Size len;
+
+        if (!dump_read(reader, &saved, sizeof(ErrorEntry)))
+            return false;
+        len = error_text_len(&saved);
+        text = reader->data + reader->pos;
+        if (reader->len - reader->pos < len)
+            return false;
+        reader->pos += len;
+
+        ticket = ENTRY_SEQ_TICKET(pg_atomic_read_u64(&saved.seq));
+        if (ticket < oldest || ticket >= next_seq || len > arena_size ||
+            (started && ticket < expected))
+            continue;
+
+        /*
+         * The first entry we keep starts the visible part of the ring,
+         * unless it was cleared and is only here for the persist worker
+         */
+        if (!started)
+        {
+            pg_atomic_write_u64(&error_buffer->cleared_seq,
+                                Max(ticket, cleared_seq));
+            started = true;
+        }
+        for (; expected < ticket; expected++)
+            pg_atomic_write_u64(&error_buffer->errors[expected % llm_helper_max_errors].dropped_seq,
+                                ENTRY_SEQ(expected));
+
+        entry = &error_buffer->errors[ticket % llm_helper_max_errors];
+        saved.text_pos = pg_atomic_fetch_add_u64(&error_buffer->arena_head, len);
+        arena_write(saved.text_pos, text, len);
+        pg_atomic_write_u64(&entry->last_seen, pg_atomic_read_u64(&saved.last_seen));
+        pg_atomic_write_u32(&entry->repeat_count,
+                            pg_atomic_read_u32(&saved.repeat_count));
+        memcpy(&entry->backend_pid, &saved.backend_pid,
+               sizeof(ErrorEntry) - offsetof(ErrorEntry, backend_pid));
+        pg_atomic_write_u64(&entry->seq, ENTRY_SEQ(ticket));
+        expected = ticket + 1;
+    }
+
+    /* Nothing before the first entry is visible, and nothing is pending */
+    if (!started)
+        pg_atomic_write_u64(&error_buffer->cleared_seq, next_seq);
+    for (; expected < next_seq; expected++)
+        pg_atomic_write_u64(&error_buffer->errors[expected % llm_helper_max_errors].dropped_seq,
+                            ENTRY_SEQ(expected));
+
+    error_buffer->restored_seq = pg_atomic_read_u64(&error_buffer->cleared_seq);
+    return true;
+}
+
+/*
+ * Put saved entries back into one of the statistics hash tables, as many as
+ * fit.  mutex_offset locates the entry's spinlock, which is reset.
+ */
+static bool
+load_hash(DumpReader *reader, HTAB *htab, Size entrysize, Size mutex_offset)
+{
+    uint64 count;
+    uint64 i;
+    char *saved = palloc(entrysize);
+
+    if (!dump_read(reader, &count, sizeof(uint64)))
+        return false;
+
+    for (i = 0; i < count; i++)
+    {
+        char *entry;
+
+        if (!dump_read(reader, saved, entrysize))
+            return false;
+        if (hash_get_num_entries(htab) >= llm_helper_max_stats)
+            continue;
+
+        /* The key is first; hash_search fills it in */
+        entry = hash_search(htab, saved, HASH_ENTER_NULL, NULL);
+        if (entry == NULL)
+            continue;
+        memcpy(entry, saved, entrysize);
+        SpinLockInit((slock_t *) (entry + mutex_offset));
+    }
+
+    pfree(saved);
+    return true;
+}
+
+/*
+ * Number of bytes of text an entry has in the arena
+ */
+static Size
+error_text_len(ErrorEntry *entry)
+{
+    Size len = (Size) entry->message_len + entry->query_len;
+    int i;
+
+    for (i = 0; i < ERROR_OBJECT_NAMES; i++)
+        len += entry->name_len[i];
+    return len;
+}
+
+/*
+ * Hook to capture log messages and errors
+ */
+static void
+llm_helper_emit_log(ErrorData *edata)
+{
+    /*
+     * Only capture errors.  The persist worker's own errors are left out, so
+     * a failure to save errors doesn't generate more errors to save.
+     */
+    if (edata->elevel >= ERROR && error_buffer != NULL && !is_persist_worker)
+    {
+        ErrorEntry staged;
+        const char *query = capture_query_text();
+
+        stage_error(edata, query, &staged);
+        if (!coalesce_error(&staged))
+        {
+            stage_error_text(edata, query, &staged);
+            last_published_seq = publish_error(&staged);
+            last_published = staged;
+        }
+
+        if (error_stats_hash != NULL)
+        {
+            ErrorStatsKey key;
+            ErrorOrigin origin;
+
+            memset(&key, 0, sizeof(key));
+            key.queryid = staged.queryid;
+            key.message_hash = staged.message_hash;
+            key.sqlerrcode = edata->sqlerrcode;
+            error_origin(&staged, &origin);
+
+            record_error_rate(&staged);
+            record_error_class(&origin, &staged);
+            record_error_sketch(&key, edata);
+            record_error_stats(&key, &origin, edata, query, &staged);
+            record_error_object(edata, &staged);
+        }
+    }
+
+    /* Call previous hook if exists */
+    if (prev_emit_log_hook)
+        prev_emit_log_hook(edata);
+}
+
+/*
+ * Query text to store with an error: the statement being executed, with its
+ * constants replaced by parameter symbols if normalize_queries is on
+ */
+static const char *
+capture_query_text(void)
+{
+    if (debug_query_string == NULL)
+        return "";
+    if (!llm_helper_normalize_queries)
+        return debug_query_string;
+
+    normalize_query(debug_query_string, normalized_query,
+                    llm_helper_max_query_length);
+    return normalized_query;
+}
+
+/*
+ * Prepare everything about an error that doesn't need a ring slot, starting
+ * with the header fields, which are filled in in backend-local memory.
+ * Together with stage_error_text this keeps the system call for the
+ * timestamp, the formatting and the bulk of the copying out of the window
+ * in which a slot is marked busy.
+ */
+static void
+stage_error(ErrorData *edata, const char *query, ErrorEntry *staged)
+{
+    staged->backend_pid = MyProcPid;
+    staged->error_level = edata->elevel;
+    staged->message_hash = error_message_hash(edata);
+    staged->queryid = error_query_id(query);
+    staged->timestamp = GetCurrentTimestamp();
+
+    /* Copy SQL state */
+    if (edata->sqlerrcode)
+        snprintf(staged->sql_state, sizeof(staged->sql_state),
+                 "%s", unpack_sql_state(edata->sqlerrcode));
+    else
+        staged->sql_state[0] = '\0';
+}
+
+/*
+ * Copy the text of a staged error into the arena, which has its own
+ * reservation scheme, and note where it went.  This is left out for errors
+ * that coalesce_error takes care of.
+ */
+static void
+stage_error_text(ErrorData *edata, const char *query, ErrorEntry *staged)
+{
+    const char *message;
+    const char *names[ERROR_OBJECT_NAMES];
+    Size query_len;
+    Size message_len;
+    Size total_len;
+    uint64 pos;
+    int i;
+
+    /* Measure the text, truncating at a character boundary */
+    message = edata->message ? edata->message : "";
+    message_len = clip_text_length(message, llm_helper_max_message_length);
+
+    query_len = clip_text_length(query, llm_helper_max_query_length);
+
+    total_len = message_len + query_len;
+    error_object_names(edata, names);
+    for (i = 0; i < ERROR_OBJECT_NAMES; i++)
+    {
+        staged->name_len[i] = names[i] ?
+            clip_text_length(names[i], NAMEDATALEN) : 0;
+        total_len += staged->name_len[i];
+    }
+
+    /* Checksum the text while no one can see this entry yet */
+    INIT_CRC32C(staged->text_crc);
+    COMP_CRC32C(staged->text_crc, message, message_len);
+    COMP_CRC32C(staged->text_crc, query, query_len);
+    for (i = 0; i < ERROR_OBJECT_NAMES; i++)
+    {
+        if (names[i] != NULL)
+            COMP_CRC32C(staged->text_crc, names[i], staged->name_len[i]);
+    }
+    FIN_CRC32C(staged->text_crc);
+
+    /* Reserve room in the arena and copy the text */
+    staged->message_len = message_len;
+    staged->query_len = query_len;
+    staged->text_pos = pg_atomic_fetch_add_u64(&error_buffer->arena_head,
+                                               total_len);
+    arena_write(staged->text_pos, message, message_len);
+    pos = staged->text_pos + message_len;
+    arena_write(pos, query, query_len);
+    pos += query_len;
+    for (i = 0; i < ERROR_OBJECT_NAMES; i++)
+    {
+        arena_write(pos, names[i], staged->name_len[i]);
+        pos += staged->name_len[i];
+    }
+}
+
+/*
+ * The object names of an error, in the order of ErrorEntry.name_len
+ */
+static void
+error_object_names(ErrorData *edata, const char *names[ERROR_OBJECT_NAMES])
+{
+    names[0] = edata->schema_name;
+    names[1] = edata->table_name;
+    names[2] = edata->column_name;
+    names[3] = edata->constraint_name;
+    names[4] = edata->datatype_name;
+}
+
+/*
+ * If a staged error repeats the one this backend published last, within
+ * COALESCE_WINDOW of it, and that entry is still in the ring and not yet
+ * saved by the persist worker, count the repeat there rather than taking a
+ * new slot.  Returns true if it did.  The window keeps a much later
+ * occurrence from hiding in an old entry, where pollers would never see it.
+ *
+ * Only the publishing backend ever updates an entry after publishing it, so
+ * there is no contention here.  The slot may be taken over by a new lap
+ * between our checks of its sequence word; then we publish the error as
+ * usual, and at worst the new entry starts out with a repeat too many and,
+ * if our timestamp is the later one, our last_seen.
+ */
+static bool
+coalesce_error(ErrorEntry *staged)
+{
+    ErrorEntry *entry;
+    uint64 ticket;
+
+    if (!llm_helper_coalesce_repeats || last_published_seq == 0)
+        return false;
+
+    /* A child process may have inherited these from the postmaster */
+    if (staged->backend_pid != last_published.backend_pid ||
+        staged->message_hash != last_published.message_hash ||
+        staged->queryid != last_published.queryid ||
+        staged->error_level != last_published.error_level ||
+        strcmp(staged->sql_state, last_published.sql_state) != 0)
+        return false;
+
+    if (staged->timestamp - last_published.timestamp > COALESCE_WINDOW)
+        return false;
+
+    /* Repeats of an error from before clear_error_history() start afresh */
+    ticket = ENTRY_SEQ_TICKET(last_published_seq);
+    if (ticket < pg_atomic_read_u64(&error_buffer->cleared_seq))
+        return false;
+
+    /* Once it's in pg_llm_error_log, later repeats wouldn't get there */
+    if (ENTRY_SEQ_NUMBER(last_published_seq) <=
+        pg_atomic_read_u64(&error_buffer->drained_seq))
+        return false;
+
+    entry = &error_buffer->errors[ticket % llm_helper_max_errors];
+    if (pg_atomic_read_u64(&entry->seq) != last_published_seq)
+        return false;
+
+    pg_atomic_fetch_add_u32(&entry->repeat_count, 1);
+    pg_atomic_monotonic_advance_u64(&entry->last_seen,
+                                    (uint64) staged->timestamp);
+
+    return pg_atomic_read_u64(&entry->seq) == last_published_seq;
+}
+
+/*
+ * Take a ticket for a staged error and publish its header in the ring.
+ * Returns the entry's sequence word, or 0 if the error had to be dropped.
+ */
+static uint64
+publish_error(ErrorEntry *staged)
+{
+    ErrorEntry *entry;
+    uint64 ticket;
+    uint64 seq;
+
+    /* Reserve the next slot in circular buffer */
+    ticket = pg_atomic_fetch_add_u64(&error_buffer->next_seq, 1);
+    entry = &error_buffer->errors[ticket % llm_helper_max_errors];
+
+    /*
+     * Claim the slot by marking it busy with our ticket.  If another writer
+     * is still filling it in, or a later ticket has already wrapped around
+     * onto it, our error is lost; waiting here would make writers block one
+     * another again.  Leave a note so cursor readers don't wait for it.
+     */
+    seq = pg_atomic_read_u64(&entry->seq);
+    for (;;)
+    {
+        if ((seq & ENTRY_SEQ_BUSY) || seq >= ENTRY_SEQ(ticket))
+        {
+            pg_atomic_monotonic_advance_u64(&entry->dropped_seq,
+                                            ENTRY_SEQ(ticket));
+            return 0;
+        }
+        if (pg_atomic_compare_exchange_u64(&entry->seq, &seq,
+                                           ENTRY_SEQ(ticket) | ENTRY_SEQ_BUSY))
+            break;
+    }
+
+    /* Everything but the atomic fields, which come first */
+    pg_atomic_write_u64(&entry->last_seen, (uint64) staged->timestamp);
+    pg_atomic_write_u32(&entry->repeat_count, 0);
+    memcpy(&entry->backend_pid, &staged->backend_pid,
+           sizeof(ErrorEntry) - offsetof(ErrorEntry, backend_pid));
+
+    /* Publish the entry */
+    pg_write_barrier();
+    pg_atomic_write_u64(&entry->seq, ENTRY_SEQ(ticket));
+
+    /* Remember it as our newest error; the postmaster has no slot */
+    if (MyProcNumber != INVALID_PROC_NUMBER)
+        pg_atomic_write_u64(&backend_state[MyProcNumber].last_seq,
+                            ENTRY_SEQ(ticket));
+
+    /*
+     * Wake up wait_for_error() callers.  The barrier pairs with the one in
+     * pg_atomic_fetch_add_u32 on the waiter side: either we see the waiter,
+     * or it sees our entry.  Broadcasting needs a PGPROC, which the
+     * postmaster lacks.
+     */
+    pg_memory_barrier();
+    if (pg_atomic_read_u32(&error_buffer->num_waiters) > 0 && MyProc != NULL)
+        ConditionVariableBroadcast(&error_buffer->new_error_cv);
+
+    return ENTRY_SEQ(ticket);
+}
+
+/*
+ * Hash where an error came from.  A zero hash means "unknown" and is not
+ * counted; murmurhash64 maps InvalidOid and a zero query ID to zero.
+ */
+static void
+error_origin(ErrorEntry *staged, ErrorOrigin *origin)
+{
+    Oid role;
+    int sec_context;
+
+    /* Unlike GetUserId, this doesn't insist on a role having been set */
+    GetUserIdAndSecContext(&role, &sec_context);
+
+    origin->pid = murmurhash64((uint64) staged->backend_pid);
+    origin->role = murmurhash64((uint64) role);
+    origin->database = murmurhash64((uint64) MyDatabaseId);
+    origin->queryid = murmurhash64(staged->queryid);
+}
+
+/*
+ * Count an error in the statistics entry for its fingerprint, creating the
+ * entry if needed.  Nothing in here may raise an error: it would recurse
+ * into the hook while we hold the hash table lock.
+ *
+ * Errors raised while this backend already holds the lock, which the hook
+ * sees before the abort releases it, are not counted.  Taking the lock
+ * again, or upgrading it to exclusive, would wait forever.
+ */
+static void
+record_error_stats(ErrorStatsKey *key, ErrorOrigin *origin, ErrorData *edata,
+                   const char *query, ErrorEntry *staged)
+{
+    ErrorStatsEntry *entry;
+    int64 minute = staged->timestamp / USECS_PER_MINUTE;
+
+    /* Waiting for the lock needs a PGPROC, which the postmaster lacks */
+    if (MyProc == NULL || LWLockHeldByMe(error_stats->lock))
+        return;
+
+    /* Lookup the hash table entry with shared lock */
+    LWLockAcquire(error_stats->lock, LW_SHARED);
+
+    entry = (ErrorStatsEntry *) hash_search(error_stats_hash, key,
+                                            HASH_FIND, NULL);
+    if (entry == NULL)
+    {
+        /* Need exclusive lock to make a new hashtable entry */
+        LWLockRelease(error_stats->lock);
+        LWLockAcquire(error_stats->lock, LW_EXCLUSIVE);
+
+        entry = error_stats_enter(key, edata, query, staged->timestamp);
+        if (entry == NULL)
+        {
+            LWLockRelease(error_stats->lock);
+            return;
+        }
+    }
+
+    SpinLockAcquire(&entry->mutex);
+    entry->count++;
+    hll_add(&entry->pids, origin->pid);
+    hll_add(&entry->roles, origin->role);
+    hll_add(&entry->databases, origin->database);
+    entry->last_seen = staged->timestamp;
+
+    /*
+     * Roll the rate over to a new minute.  Backends take their timestamps
+     * before getting here, so an error can arrive a little out of order; it
+     * is then counted in the current minute.
+     */
+    if (minute > entry->rate_minute)
+    {
+        rate_ewma_advance(&entry->rate_mean, &entry->rate_var,
+                          entry->rate_count, minute - entry->rate_minute);
+        entry->rate_minute = minute;
+        entry->rate_count = 0;
+    }
+    entry->rate_count++;
+    SpinLockRelease(&entry->mutex);
+
+    LWLockRelease(error_stats->lock);
+}
+
+/*
+ * Count an error in the statistics of the table or constraint it is about,
+ * if any.  Like record_error_stats, this must not raise an error, and skips
+ * errors raised while this backend holds the lock.
+ */
+static void
+record_error_object(ErrorData *edata, ErrorEntry *staged)
+{
+    ErrorObjectKey key;
+    ErrorObjectEntry *entry;
+
+    if (MyProc == NULL || LWLockHeldByMe(error_stats->lock) ||
+        (edata->table_name == NULL && edata->constraint_name == NULL))
+        return;
+
+    memset(&key, 0, sizeof(key));
+    key.dbid = MyDatabaseId;
+    key.sqlerrcode = edata->sqlerrcode;
+    clip_text_copy(key.schema_name, edata->schema_name, NAMEDATALEN);
+    clip_text_copy(key.table_name, edata->table_name, NAMEDATALEN);
+    clip_text_copy(key.constraint_name, edata->constraint_name, NAMEDATALEN);
+
+    LWLockAcquire(error_stats->lock, LW_SHARED);
+
+    entry = (ErrorObjectEntry *) hash_search(error_objects_hash, &key,
+                                             HASH_FIND, NULL);
+    if (entry == NULL)
+    {
+        LWLockRelease(error_stats->lock);
+        LWLockAcquire(error_stats->lock, LW_EXCLUSIVE);
+
+        entry = (ErrorObjectEntry *) hash_search(error_objects_hash, &key,
+                                                 HASH_FIND, NULL);
+        if (entry == NULL)
+        {
+            if (hash_get_num_entries(error_objects_hash) >= llm_helper_max_stats)
+                error_stats_dealloc(error_objects_hash,
+                                    offsetof(ErrorObjectEntry, count));
+
+            entry = (ErrorObjectEntry *) hash_search(error_objects_hash, &key,
+                                                     HASH_ENTER_NULL, NULL);
+            if (entry == NULL)
+            {
+                LWLockRelease(error_stats->lock);
+                return;
+            }
+
+            SpinLockInit(&entry->mutex);
+            entry->count = 0;
+            entry->first_seen = staged->timestamp;
+            entry->last_seen = staged->timestamp;
+        }
+    }
+
+    SpinLockAcquire(&entry->mutex);
+    entry->count++;
+    entry->last_seen = staged->timestamp;
+    SpinLockRelease(&entry->mutex);
+
+    LWLockRelease(error_stats->lock);
+}
+
+/*
+ * Count an error in the statistics of its SQLSTATE class
+ */
+static void
+record_error_class(ErrorOrigin *origin, ErrorEntry *staged)
+{
+    ErrorClassStats *class;
+
+    class = &error_stats->classes[sqlstate_class_index(staged->sql_state)];
+
+    SpinLockAcquire(&class->mutex);
+    class->count++;
+    hll_add(&class->pids, origin->pid);
+    hll_add(&class->roles, origin->role);
+    hll_add(&class->databases, origin->database);
+    hll_add(&class->queryids, origin->queryid);
+    SpinLockRelease(&class->mutex);
+}
+
+/*
+ * Add a hashed value to a distinct counter.  The top HLL_BITS bits of the
+ * hash pick a register, which keeps the highest position of the first one
+ * bit in the rest.  A zero hash is ignored.
+ */
+static void
+hll_add(HyperLogLog *hll, uint64 hash)
+{
+    int index;
+    uint64 rest;
+    uint8 rank;
+
+    if (hash == 0)
+        return;
+
+    index = hash >> (64 - HLL_BITS);
+    rest = hash << HLL_BITS;
+    if (rest == 0)
+        rank = 64 - HLL_BITS + 1;
+    else
+        rank = 64 - pg_leftmost_one_pos64(rest);
+
+    hll->registers[index] = Max(hll->registers[index], rank);
+}
+
+/*
+ * Estimated number of distinct values added to a counter, using linear
+ * counting while the estimate is small
+ */
+static int64
+hll_estimate(const HyperLogLog *hll)
+{
+    const double alpha = 0.709;     /* bias correction for 64 registers */
+    double sum = 0.0;
+    int zeros = 0;
+    double estimate;
+    int i;
+
+    for (i = 0; i < HLL_REGISTERS; i++)
+    {
+        sum += ldexp(1.0, -hll->registers[i]);
+        if (hll->registers[i] == 0)
+            zeros++;
+    }
+
+    if (zeros == HLL_REGISTERS)
+        return 0;
+
+    estimate = alpha * HLL_REGISTERS * HLL_REGISTERS / sum;
+    if (estimate <= 2.5 * HLL_REGISTERS && zeros > 0)
+        estimate = HLL_REGISTERS * log((double) HLL_REGISTERS / zeros);
+
+    return (int64) rint(estimate);
+}
+
+/*
+ * Fold the error count of a finished minute into a moving average and
+ * variance, followed by minutes - 1 minutes without errors.  Folding in k
+ * zeros at once works out to mean * b^k and b^k * (var + mean^2 * (1 - b^k))
+ * with b = 1 - alpha, so a long quiet period costs no more than a short one.
+ */
+static void
+rate_ewma_advance(double *mean, double *var, int64 count, int64 minutes)
+{
+    double diff = (double) count - *mean;
+    double increment = RATE_EWMA_ALPHA * diff;
+    double decay;
+
+    *mean += increment;
+    *var = (1.0 - RATE_EWMA_ALPHA) * (*var + diff * increment);
+
+    if (minutes > 1)
+    {
+        decay = pow(1.0 - RATE_EWMA_ALPHA, (double) (minutes - 1));
+        *var = decay * (*var + *mean * *mean * (1.0 - decay));
+        *mean *= decay;
+    }
+}
+
+/*
+ * Find or create the statistics entry for key.  Caller must hold the hash
+ * table lock exclusively.  Returns NULL if there is no room for it.
+ */
+static ErrorStatsEntry *
+error_stats_enter(ErrorStatsKey *key, ErrorData *edata, const char *query,
+                  TimestampTz now)
+{
+    ErrorStatsEntry *entry;
+
+    /* Someone else may have created it while we waited for the lock */
+    entry = (ErrorStatsEntry *) hash_search(error_stats_hash, key,
+                                            HASH_FIND, NULL);
+    if (entry != NULL)
+        return entry;
+
+    /* Make room if needed */
+    if (hash_get_num_entries(error_stats_hash) >= llm_helper_max_stats)
+        error_stats_dealloc(error_stats_hash, offsetof(ErrorStatsEntry, count));
+
+    /* HASH_ENTER would raise an error if shared memory ran out */
+    entry = (ErrorStatsEntry *) hash_search(error_stats_hash, key,
+                                            HASH_ENTER_NULL, NULL);
+    if (entry == NULL)
+        return NULL;
+
+    SpinLockInit(&entry->mutex);
+    entry->count = 0;
+    memset(&entry->pids, 0, sizeof(HyperLogLog));
+    memset(&entry->roles, 0, sizeof(HyperLogLog));
+    memset(&entry->databases, 0, sizeof(HyperLogLog));
+    entry->first_seen = now;
+    entry->last_seen = now;
+    entry->rate_minute = now / USECS_PER_MINUTE;
+    entry->rate_count = 0;
+    entry->rate_mean = 0.0;
+    entry->rate_var = 0.0;
+
+    clip_text_copy(entry->sample_message, edata->message,
+                   ERROR_STATS_SAMPLE_MESSAGE_LEN);
+    clip_text_copy(entry->sample_query, query, ERROR_STATS_SAMPLE_QUERY_LEN);
+
+    return entry;
+}
+
+/*
+ * Evict the least frequent entries of one of the statistics hash tables to
+ * make room for new ones.  Their int64 count is at count_offset.  Caller
+ * must hold the hash table lock exclusively.
+ *
+ * Rather than sorting, which would need memory we can't allocate in the
+ * hook, find the lowest count and remove entries that have it, up to 5% of
+ * the table, so a burst of new entries doesn't take this path for every
+ * one of them.
+ */
+#define ENTRY_COUNT(entry, count_offset) \
+    (*(int64 *) ((char *) (entry) + (count_offset)))
+
+static void
+error_stats_dealloc(HTAB *htab, Size count_offset)
+{
+    HASH_SEQ_STATUS hash_seq;
+    void *entry;
+    int64 min_count = PG_INT64_MAX;
+    int nvictims;
+
+    hash_seq_init(&hash_seq, htab);
+    while ((entry = hash_seq_search(&hash_seq)) != NULL)
+        min_count = Min(min_count, ENTRY_COUNT(entry, count_offset));
+
+    nvictims = Max(10, llm_helper_max_stats / 20);
+    hash_seq_init(&hash_seq, htab);
+    while ((entry = hash_seq_search(&hash_seq)) != NULL)
+    {
+        if (ENTRY_COUNT(entry, count_offset) > min_count)
+            continue;
+        /* The key comes first in every entry */
+        hash_search(htab, entry, HASH_REMOVE, NULL);
+        if (--nvictims == 0)
+        {
+            hash_seq_term(&hash_seq);
+            break;
+        }
+    }
+}
+
+/*
+ * 64-bit hash of a statistics key
+ */
+static uint64
+error_fingerprint(ErrorStatsKey *key)
+{
+    return hash_bytes_extended((const unsigned char *) key,
+                               sizeof(ErrorStatsKey), 0);
+}
+
+/*
+ * Count an error in the sketch, and make it a top error candidate if its
+ * estimate is high enough.  Lock-free: writers never wait for each other.
+ */
+static void
+record_error_sketch(ErrorStatsKey *key, ErrorData *edata)
+{
+    uint64 fingerprint = error_fingerprint(key);
+    uint64 estimate;
+    uint64 min_estimate = PG_UINT64_MAX;
+    int min_index = -1;
+    int slot = -1;
+    int i;
+
+    estimate = sketch_add(fingerprint);
+    if (estimate <= pg_atomic_read_u64(&error_sketch->threshold))
+        return;
+
+    /* Someone else is updating the candidates; they'll catch up later */
+    if (!pg_atomic_test_set_flag(&error_sketch->candidates_lock))
+        return;
+
+    for (i = 0; i < error_sketch->num_candidates; i++)
+    {
+        TopErrorCandidate *candidate = &error_sketch->candidates[i];
+        uint64 candidate_estimate;
+
+        if (candidate->fingerprint == fingerprint)
+            break;
+
+        candidate_estimate = sketch_estimate(candidate->fingerprint);
+        if (candidate_estimate < min_estimate)
+        {
+            min_estimate = candidate_estimate;
+            min_index = i;
+        }
+    }
+
+    /* Already a candidate */
+    if (i < error_sketch->num_candidates)
+    {
+        pg_atomic_clear_flag(&error_sketch->candidates_lock);
+        return;
+    }
+
+    /* Take a free slot, or push out the least frequent candidate */
+    if (error_sketch->num_candidates < TOP_ERRORS_CANDIDATES)
+        slot = error_sketch->num_candidates++;
+    else if (estimate > min_estimate)
+        slot = min_index;
+
+    if (slot >= 0)
+    {
+        TopErrorCandidate *candidate = &error_sketch->candidates[slot];
+
+        candidate->fingerprint = fingerprint;
+        candidate->key = *key;
+        clip_text_copy(candidate->sample_message, edata->message,
+                       ERROR_STATS_SAMPLE_MESSAGE_LEN);
+        min_estimate = Min(min_estimate, estimate);
+    }
+
+    /*
+     * Candidates' estimates only grow, so the lowest one we saw is a safe
+     * lower bound for the next error to beat.
+     */
+    if (error_sketch->num_candidates == TOP_ERRORS_CANDIDATES)
+        pg_atomic_write_u64(&error_sketch->threshold, min_estimate);
+
+    pg_atomic_clear_flag(&error_sketch->candidates_lock);
+}
+
+/*
+ * Sketch counter for a fingerprint in the given row.  The row hashes are
+ * derived from the two halves of the fingerprint.
+ */
+#define SKETCH_COUNTER(fingerprint, row) \
+    (&error_sketch->counters[row] \
+     [((uint32) (fingerprint) + (row) * ((uint32) ((fingerprint) >> 32) | 1)) % \
+      SKETCH_WIDTH])
+
+/*
+ * Count one occurrence of a fingerprint in the sketch, and return its new
+ * estimate
+ */
+static uint64
+sketch_add(uint64 fingerprint)
+{
+    uint64 estimate = PG_UINT64_MAX;
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; row++)
+    {
+        uint64 count;
+
+        count = pg_atomic_add_fetch_u64(SKETCH_COUNTER(fingerprint, row), 1);
+        estimate = Min(estimate, count);
+    }
+    return estimate;
+}
+
+/*
+ * Estimated number of occurrences of a fingerprint
+ */
+static uint64
+sketch_estimate(uint64 fingerprint)
+{
+    uint64 estimate = PG_UINT64_MAX;
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; row++)
+        estimate = Min(estimate,
+                       pg_atomic_read_u64(SKETCH_COUNTER(fingerprint, row)));
+    return estimate;
+}
+
+/*
+ * Count an error in the bucket of the minute it occurred in.  The first
+ * writer to get to a bucket in a new minute claims it and zeroes the counts
+ * from a day ago; writers of the same minute wait the few instructions that
+ * takes.  Errors timestamped before the bucket's minute, which can only
+ * happen to a writer that was descheduled for a day, are not counted.
+ */
+static void
+record_error_rate(ErrorEntry *staged)
+{
+    int64 minute = staged->timestamp / USECS_PER_MINUTE;
+    ErrorRateBucket *bucket = &error_rates[minute % RATE_BUCKETS];
+    uint64 tag = pg_atomic_read_u64(&bucket->minute);
+    int level = Min(staged->error_level - ERROR, RATE_LEVELS - 1);
+
+    while (tag != RATE_MINUTE(minute))
+    {
+        if ((tag & ~(uint64) RATE_MINUTE_CLAIMED) > RATE_MINUTE(minute))
+            return;
+
+        if (tag & RATE_MINUTE_CLAIMED)
+        {
+            pg_spin_delay();
+            tag = pg_atomic_read_u64(&bucket->minute);
+            continue;
+        }
+
+        if (pg_atomic_compare_exchange_u64(&bucket->minute, &tag,
+                                           RATE_MINUTE(minute) | RATE_MINUTE_CLAIMED))
+        {
+            int i;
+            int j;
+
+            for (i = 0; i < RATE_LEVELS; i++)
+                for (j = 0; j < SQLSTATE_CLASSES; j++)
+                    pg_atomic_write_u32(&bucket->counts[i][j], 0);
+            pg_write_barrier();
+            pg_atomic_write_u64(&bucket->minute, RATE_MINUTE(minute));
+            break;
+        }
+    }
+
+    /* Pairs with the write barrier above */
+    pg_read_barrier();
+    pg_atomic_fetch_add_u32(&bucket->counts[level][sqlstate_class_index(staged->sql_state)],
+                            1);
+}
+
+/*
+ * Index of the counter for an SQLSTATE's class
+ */
+static int
+sqlstate_class_index(const char *sql_state)
+{
+    int i;
+
+    for (i = 0; i < lengthof(sqlstate_classes); i++)
+    {
+        if (sql_state[0] == sqlstate_classes[i][0] &&
+            sql_state[1] == sqlstate_classes[i][1])
+            return i;
+    }
+    return lengthof(sqlstate_classes);
+}
+
+/*
+ * qsort comparator: highest estimate first
+ */
+static int
+top_error_cmp(const void *a, const void *b)
+{
+    const TopErrorRow *ra = (const TopErrorRow *) a;
+    const TopErrorRow *rb = (const TopErrorRow *) b;
+
+    if (ra->estimate != rb->estimate)
+        return ra->estimate > rb->estimate ? -1 : 1;
+    return ra->index - rb->index;
+}
+
+/*
+ * Hash of the untranslated message format string, which is the same for
+ * every occurrence of an error whatever its parameters.  Messages that
+ * weren't built from a format string are hashed as they are.
+ */
+static uint64
+error_message_hash(ErrorData *edata)
+{
+    const char *template;
+
+    template = edata->message_id ? edata->message_id : edata->message;
+    if (template == NULL)
+        return 0;
+
+    return hash_bytes_extended((const unsigned char *) template,
+                               strlen(template), 0);
+}
+
+/*
+ * Query ID of the statement that failed, as computed by parse analysis, so
+ * errors can be joined with pg_stat_statements.  Statements that never got
+ * that far, syntax errors above all, get a hash of their normalized text
+ * instead, so that they still group by statement.  Returns 0 if there is no
+ * statement at all.
+ *
+ * query is the text as captured, which is already normalized if
+ * normalize_queries is on.
+ */
+static uint64
+error_query_id(const char *query)
+{
+    uint64 queryid = pgstat_get_my_query_id();
+
+    if (queryid != 0 || query[0] == '\0')
+        return queryid;
+
+    if (!llm_helper_normalize_queries)
+    {
+        normalize_query(query, normalized_query, llm_helper_max_query_length);
+        query = normalized_query;
+    }
+
+    return hash_bytes_extended((const unsigned char *) query,
+                               strlen(query), 0);
+}
+
+/*
+ * Length of an interval in microseconds, counting months as 30 days.
+ * Infinite intervals, and those too long for an int64, come out as
+ * PG_INT64_MAX or PG_INT64_MIN.
+ */
+static int64
+interval_to_usecs(Interval *interval)
+{
+    int64 days;
+    int64 usecs;
+
+    if (INTERVAL_IS_NOBEGIN(interval))
+        return PG_INT64_MIN;
+    if (INTERVAL_IS_NOEND(interval))
+        return PG_INT64_MAX;
+
+    days = (int64) interval->month * DAYS_PER_MONTH + interval->day;
+    if (pg_mul_s64_overflow(days, USECS_PER_DAY, &usecs))
+        return days < 0 ? PG_INT64_MIN : PG_INT64_MAX;
+    if (pg_add_s64_overflow(usecs, interval->time, &usecs))
+        return interval->time < 0 ? PG_INT64_MIN : PG_INT64_MAX;
+    return usecs;
+}
+
+/*
+ * Length of str truncated to less than limit bytes, at a character boundary
+ */
+static Size
+clip_text_length(const char *str, int limit)
+{
+    Size len = strnlen(str, limit);
+
+    if (len == limit)
+        len = pg_mbcliplen(str, len, limit - 1);
+    return len;
+}
+
+/*
+ * Copy str, or an empty string for NULL, into a buffer of size bytes,
+ * truncating at a character boundary
+ */
+static void
+clip_text_copy(char *dst, const char *src, int size)
+{
+    Size len;
+
+    if (src == NULL)
+        src = "";
+    len = clip_text_length(src, size);
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+/* Characters that can start, and continue, an identifier or keyword */
+#define IS_IDENT_START(c) \
+    (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+     (c) == '_' || IS_HIGHBIT_SET(c))
+#define IS_IDENT_CONT(c) \
+    (IS_IDENT_START(c) || ((c) >= '0' && (c) <= '9') || (c) == '$')
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+/*
+ * Copy query into dst, at most size bytes including the terminator, with
+ * every constant replaced by a parameter symbol, so "WHERE id = 42 AND name
+ * = 'bob'" becomes "WHERE id = $1 AND name = $2".  Returns the length of the
+ * result.
+ *
+ * This scans the text with just enough of the lexer to find constants:
+ * strings in all their forms, dollar-quoted strings and numbers, skipping
+ * over comments, quoted identifiers and identifiers that might contain
+ * digits.  Unlike pg_stat_statements, which uses the locations recorded by
+ * parse analysis, it works for statements that failed to parse, which is
+ * where many errors come from.  Existing parameter symbols are kept, and as
+ * in pg_stat_statements, constants are numbered after the highest one
+ * anywhere in the query, so "VALUES ('new', $1)" becomes "VALUES ($2, $1)".
+ * Finding that takes a first pass that writes nothing.
+ */
+static Size
+normalize_query(const char *query, char *dst, Size size)
+{
+    NormalizeState state;
+    const char *p;
+
+    state.dst = NULL;
+    state.size = SIZE_MAX;
+    state.len = 0;
+    state.next_param = 1;
+    normalize_scan(query, &state);
+
+    state.dst = dst;
+    state.size = size - 1;
+    state.len = 0;
+    p = normalize_scan(query, &state);
+
+    /* Don't leave a partial character behind if we ran out of room */
+    if (*p != '\0')
+        state.len = pg_mbcliplen(dst, state.len, state.len);
+    dst[state.len] = '\0';
+
+    return state.len;
+}
+
+/*
+ * One pass of normalize_query() over the text starting at p.  Returns where
+ * it stopped, which is before the end if the output ran out of room.
+ */
+static const char *
+normalize_scan(const char *p, NormalizeState *state)
+{
+    while (*p != '\0' && state->len < state->size)
+    {
+        const unsigned char c = (unsigned char) *p;
+        const char *start = p;
+
+        if (IS_IDENT_START(c))
+        {
+            while (IS_IDENT_CONT((unsigned char) *p))
+                p++;
+
+            /* E'...', B'...', X'...', N'...' and U&'...' are constants */
+            if (p - start == 1 && *p == '\'' && strchr("eEbBxXnN", c) != NULL)
+            {
+                p = skip_quoted(p, '\'', c == 'e' || c == 'E');
+                normalize_append_param(state);
+            }
+            else if (p - start == 1 && (c == 'u' || c == 'U') &&
+                     p[0] == '&' && p[1] == '\'')
+            {
+                p = skip_quoted(p + 1, '\'', false);
+                normalize_append_param(state);
+            }
+            else
+                normalize_append(state, start, p - start);
+        }
+        else if (c == '\'')
+        {
+            p = skip_quoted(p, '\'', !standard_conforming_strings);
+            normalize_append_param(state);
+        }
+        else if (c == '"')
+        {
+            p = skip_quoted(p, '"', false);
+            normalize_append(state, start, p - start);
+        }
+        else if (c == '$' && IS_DIGIT((unsigned char) p[1]))
+        {
+            int param = 0;
+
+            /* An existing parameter symbol */
+            for (p++; IS_DIGIT((unsigned char) *p); p++)
+                param = Min(param * 10 + (*p - '0'), PG_INT32_MAX / 10);
+            state->next_param = Max(state->next_param, param + 1);
+            normalize_append(state, start, p - start);
+        }
+        else if (c == '$')
+        {
+            bool is_quote;
+
+            p = skip_dollar_quoted(p, &is_quote);
+            if (is_quote)
+                normalize_append_param(state);
+            else
+                normalize_append(state, start, p - start);
+        }
+        else if ((c == '-' && p[1] == '-') || (c == '/' && p[1] == '*'))
+        {
+            p = skip_comment(p);
+            normalize_append(state, start, p - start);
+        }
+        else if (IS_DIGIT(c) || (c == '.' && IS_DIGIT((unsigned char) p[1])))
+        {
+            p = skip_number(p);
+            normalize_append_param(state);
+        }
+        else
+        {
+            p++;
+            normalize_append(state, start, 1);
+        }
+    }
+
+    return p;
+}
+
+/*
+ * Append len bytes of src to the normalized query, as many as fit
+ */
+static void
+normalize_append(NormalizeState *state, const char *src, Size len)
+{
+    if (state->dst == NULL)
+        return;
+
+    len = Min(len, state->size - state->len);
+    memcpy(state->dst + state->len, src, len);
+    state->len += len;
+}
+
+/*
+ * Append the next parameter symbol to the normalized query
+ */
+static void
+normalize_append_param(NormalizeState *state)
+{
+    char buf[16];
+    int len;
+
+    if (state->dst == NULL)
+        return;
+
+    len = snprintf(buf, sizeof(buf), "$%d", state->next_param++);
+    normalize_append(state, buf, len);
+}
+
+/*
+ * Skip a string or quoted identifier starting at the quote character p
+ * points to.  A doubled quote stands for itself, and if backslash is true
+ * so does a quote after a backslash.  Returns the position after the closing
+ * quote, or of the terminator if the text ends first.
+ */
+static const char *
+skip_quoted(const char *p, char quote, bool backslash)
+{
+    for (p++; *p != '\0'; p++)
+    {
+        if (backslash && *p == '\\' && p[1] != '\0')
+            p++;
+        else if (*p == quote)
+        {
+            if (p[1] != quote)
+                return p + 1;
+            p++;
+        }
+    }
+    return p;
+}
+
+/*
+ * Skip a "--" comment, up to the end of the line, or a possibly nested
+ * C-style comment
+ */
+static const char *
+skip_comment(const char *p)
+{
+    int depth = 0;
+
+    if (p[0] == '-')
+    {
+        while (*p != '\0' && *p != '\n')
+            p++;
+        return p;
+    }
+
+    while (*p != '\0')
+    {
+        if (p[0] == '/' && p[1] == '*')
+        {
+            depth++;
+            p += 2;
+        }
+        else if (p[0] == '*' && p[1] == '/')
+        {
+            p += 2;
+            if (--depth == 0)
+                break;
+        }
+        else
+            p++;
+    }
+    return p;
+}
+
+/*
+ * Skip a dollar-quoted string starting at p, setting *is_quote.  If p turns
+ * out not to start one, just skip the dollar sign.
+ */
+static const char *
+skip_dollar_quoted(const char *p, bool *is_quote)
+{
+    const char *tag = p;
+    Size tag_len;
+
+    *is_quote = false;
+
+    /* The tag follows identifier rules, minus dollar signs */
+    p++;
+    if (IS_IDENT_START((unsigned char) *p))
+    {
+        while (IS_IDENT_CONT((unsigned char) *p) && *p != '$')
+            p++;
+    }
+    if (*p != '$')
+        return tag + 1;
+
+    *is_quote = true;
+    tag_len = p - tag + 1;
+
+    /* Find the closing tag */
+    for (p++; *p != '\0'; p++)
+    {
+        if (*p == '$' && strncmp(p, tag, tag_len) == 0)
+            return p + tag_len;
+    }
+    return p;
+}
+
+/*
+ * Skip a numeric constant: integers, decimals, exponents, and the
+ * hexadecimal, octal and binary forms with their underscores
+ */
+static const char *
+skip_number(const char *p)
+{
+    for (;;)
+    {
+        unsigned char c = (unsigned char) *p;
+
+        if (IS_DIGIT(c) || c == '.' || c == '_' ||
+            (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+            p++;
+        else if ((c == '+' || c == '-') && (p[-1] == 'e' || p[-1] == 'E') &&
+                 IS_DIGIT((unsigned char) p[1]))
+            p++;
+        else
+            return p;
+    }
+}
+
+/*
+ * Copy len bytes into the arena at position pos, wrapping around its end
+ */
+static void
+arena_write(uint64 pos, const char *src, Size len)
+{
+    Size offset = pos % arena_size;
+    Size first = Min(len, arena_size - offset);
+
+    memcpy(error_arena + offset, src, first);
+    if (first < len)
+        memcpy(error_arena, src + first, len - first);
+}
+
+/*
+ * Copy len bytes out of a ring's arena at position pos, wrapping around its
+ * end
+ */
+static void
+arena_read(ErrorRing *ring, uint64 pos, char *dest, Size len)
+{
+    Size offset = pos % ring->arena_size;
+    Size first = Min(len, ring->arena_size - offset);
+
+    memcpy(dest, ring->arena + offset, first);
+    if (first < len)
+        memcpy(dest + first, ring->arena, len - first);
+}
+
+/*
+ * Copy a published entry header out of shared memory into dest.  Returns
+ * false if the slot is empty or a writer is filling it in.  Retries if the
+ * slot was overwritten while we copied it.
+ */
+static bool
+read_error_entry(ErrorEntry *entry, ErrorEntry *dest)
+{
+    for (;;)
+    {
+        uint64 before;
+        uint64 after;
+
+        before = pg_atomic_read_u64(&entry->seq);
+        if (before == 0 || (before & ENTRY_SEQ_BUSY))
+            return false;
+
+        pg_read_barrier();
+        memcpy(dest, entry, sizeof(ErrorEntry));
+        pg_read_barrier();
+
+        after = pg_atomic_read_u64(&entry->seq);
+        if (before == after)
+            return true;
+
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+/*
+ * Fill in dest from a header obtained by read_error_entry, copying the text
+ * out of the arena into palloc'd strings.  Returns false if newer errors
+ * have already overwritten the text, or if the lengths are out of bounds or
+ * the text doesn't match its checksum.
+ */
+static bool
+read_error_text(ErrorRing *ring, ErrorEntry *header, ErrorRecord *dest)
+{
+    char *text;
+    char *names;
+    Size names_len = 0;
+    uint64 head;
+    pg_crc32c crc;
+    int i;
+
+    for (i = 0; i < ERROR_OBJECT_NAMES; i++)
+        names_len += header->name_len[i];
+
+    /*
+     * The previous run's ring comes from a file a crash may have left torn
+     * or that may be corrupt, so check the lengths before trusting them
+     */
+    if (header->message_len > (uint32) llm_helper_max_message_length ||
+        header->query_len > (uint32) llm_helper_max_query_length ||
+        names_len > ERROR_OBJECT_NAMES * NAMEDATALEN ||
+        error_text_len(header) > ring->arena_size)
+        return false;
+
+    text = palloc(header->message_len + header->query_len + 2 +
+                  names_len + ERROR_OBJECT_NAMES);
+    arena_read(ring, header->text_pos, text, header->message_len);
+    arena_read(ring, header->text_pos + header->message_len,
+               text + header->message_len + 1, header->query_len);
+
+    /* The names follow, each with a terminator of its own */
+    names = text + header->message_len + header->query_len + 2;
+    arena_read(ring, header->text_pos + header->message_len + header->query_len,
+               names, names_len);
+
+    /* Writers advance arena_head before writing, so check it afterwards */
+    pg_read_barrier();
+    head = pg_atomic_read_u64(&ring->buffer->arena_head);
+    if (head > header->text_pos + ring->arena_size)
+    {
+        pfree(text);
+        return false;
+    }
+
+    /* A writer that fell a lap behind may have written over it, though */
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, text, header->message_len);
+    COMP_CRC32C(crc, text + header->message_len + 1, header->query_len);
+    COMP_CRC32C(crc, names, names_len);
+    FIN_CRC32C(crc);
+    if (!EQ_CRC32C(crc, header->text_crc))
+    {
+        pfree(text);
+        return false;
+    }
+
+    text[header->message_len] = '\0';
+    text[header->message_len + 1 + header->query_len] = '\0';
+
+    dest->seq = ENTRY_SEQ_NUMBER(pg_atomic_read_u64(&header->seq));
+    dest->backend_pid = header->backend_pid;
+    memcpy(dest->sql_state, header->sql_state, sizeof(dest->sql_state));
+    dest->error_level = header->error_level;
+    dest->message_hash = header->message_hash;
+    dest->queryid = header->queryid;
+    dest->repeat_count = pg_atomic_read_u32(&header->repeat_count);
+    dest->last_seen = (TimestampTz) pg_atomic_read_u64(&header->last_seen);
+    dest->timestamp = header->timestamp;
+    dest->error_message = text;
+    dest->query_text = text + header->message_len + 1;
+
+    /* Spread the names out to make room for their terminators */
+    for (i = ERROR_OBJECT_NAMES - 1; i >= 0; i--)
+    {
+        char *name;
+
+        names_len -= header->name_len[i];
+        name = names + names_len + i;
+        memmove(name, names + names_len, header->name_len[i]);
+        name[header->name_len[i]] = '\0';
+        dest->object_names[i] = header->name_len[i] > 0 ? name : NULL;
+    }
+    dest->from_previous_run = (ring != &current_ring);
+    return true;
+}
+
+/*
+ * Look up the header of the error with the given ticket in a ring
+ */
+static TicketState
+read_ticket_header(ErrorRing *ring, uint64 ticket, ErrorEntry *header)
+{
+    if (ticket < pg_atomic_read_u64(&ring->buffer->cleared_seq))
+        return TICKET_CLEARED;
+
+    return read_slot_header(ring, ticket, header);
+}
+
+/*
+ * Like read_ticket_header, but errors from before the last
+ * clear_error_history() stay visible as long as they haven't been
+ * overwritten.  Clearing never wipes anything, so they are still there.
+ */
+static TicketState
+read_slot_header(ErrorRing *ring, uint64 ticket, ErrorEntry *header)
+{
+    ErrorEntry *entry = &ring->buffer->errors[ticket % ring->max_errors];
+    uint64 seq;
+
+    if (read_error_entry(entry, header))
+    {
+        seq = pg_atomic_read_u64(&header->seq);
+        if (seq == ENTRY_SEQ(ticket))
+            return TICKET_READ;
+    }
+    else
+        seq = pg_atomic_read_u64(&entry->seq);
+
+    /* A later lap has taken the slot, or our writer had to give up on it */
+    if ((seq & ~(uint64) ENTRY_SEQ_BUSY) > ENTRY_SEQ(ticket) ||
+        pg_atomic_read_u64(&entry->dropped_seq) >= ENTRY_SEQ(ticket))
+        return TICKET_LOST;
+
+    return TICKET_PENDING;
+}
+
+/*
+ * Look up the error with the given ticket in a ring and copy it into dest
+ */
+static TicketState
+read_ticket(ErrorRing *ring, uint64 ticket, ErrorRecord *dest)
+{
+    ErrorEntry header;
+    TicketState state;
+
+    state = read_ticket_header(ring, ticket, &header);
+    if (state == TICKET_READ && !read_error_text(ring, &header, dest))
+        state = TICKET_LOST;
+    return state;
+}
+
+/*
+ * First ticket a cursor positioned at after_seq still has to look at.
+ * Sets *lost to the number of tickets in between that a full lap of the
+ * ring has overwritten.  Tickets from before the last clear are skipped
+ * unless include_cleared is set.
+ */
+static uint64
+cursor_first_ticket(int64 after_seq, uint64 next_seq, bool include_cleared,
+                    uint64 *lost)
+{
+    uint64 ticket;
+    uint64 oldest;
+
+    /*
+     * A cursor from before a server restart can be ahead of the buffer;
+     * start over from the beginning in that case.  Sequence number n
+     * belongs to ticket n - 1, so the first ticket we want is after_seq.
+     */
+    if (after_seq < 0 || (uint64) after_seq > next_seq)
+        after_seq = 0;
+    ticket = (uint64) after_seq;
+    if (!include_cleared)
+        ticket = Max(ticket, pg_atomic_read_u64(&error_buffer->cleared_seq));
+
+    /* Anything more than one lap behind has been overwritten */
+    oldest = next_seq > (uint64) llm_helper_max_errors ?
+        next_seq - llm_helper_max_errors : 0;
+    *lost = 0;
+    if (ticket < oldest)
+    {
+        *lost = oldest - ticket;
+        ticket = oldest;
+    }
+    return ticket;
+}
+
+/*
+ * Has an error with a sequence number above after_seq been published?
+ * Lost tickets are skipped, so this agrees with whether get_errors_since
+ * would return a row.
+ */
+static bool
+error_published_since(int64 after_seq)
+{
+    uint64 next_seq = pg_atomic_read_u64(&error_buffer->next_seq);
+    uint64 lost;
+    uint64 ticket;
+
+    for (ticket = cursor_first_ticket(after_seq, next_seq, false, &lost);
+         ticket < next_seq;
+         ticket++)
+    {
+        ErrorEntry header;
+
+        switch (read_ticket_header(&current_ring, ticket, &header))
+        {
+            case TICKET_READ:
+                return true;
+            case TICKET_LOST:
+            case TICKET_CLEARED:
+                continue;
+            case TICKET_PENDING:
+                return false;
+        }
+    }
+    return false;
+}
+
+/*
+ * Fill in the columns that every function returning captured errors has,
+ * ERROR_RECORD_COLS of them
+ */
+static void
+error_record_values(ErrorRecord *record, Datum *values, bool *nulls)
+{
+    int i;
+
+    memset(nulls, 0, sizeof(bool) * ERROR_RECORD_COLS);
+    values[0] = Int32GetDatum(record->backend_pid);
+    values[1] = CStringGetTextDatum(record->query_text);
+    values[2] = CStringGetTextDatum(record->error_message);
+    values[3] = CStringGetTextDatum(record->sql_state);
+    values[4] = Int32GetDatum(record->error_level);
+    values[5] = TimestampTzGetDatum(record->timestamp);
+    values[6] = Int64GetDatum((int64) record->message_hash);
+    if (record->queryid != 0)
+        values[7] = Int64GetDatum((int64) record->queryid);
+    else
+        nulls[7] = true;
+    values[8] = Int64GetDatum((int64) record->repeat_count);
+    values[9] = TimestampTzGetDatum(record->last_seen);
+    for (i = 0; i < ERROR_OBJECT_NAMES; i++)
+    {
+        if (record->object_names[i] != NULL)
+            values[10 + i] = CStringGetTextDatum(record->object_names[i]);
+        else
+            nulls[10 + i] = true;
+    }
+}
+
+/*
+ * SQL function: get_last_error()
+ * Returns the most recent error for the current backend
+ */
+Datum
+get_last_error(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    Datum values[ERROR_RECORD_COLS];
+    bool nulls[ERROR_RECORD_COLS];
+    HeapTuple tuple;
+    ErrorEntry latest;
+    ErrorRecord record;
+    uint64 last_seq;
+
+    if (error_buffer == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    /* Build tuple descriptor */
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("function returning record called in context that cannot accept type record")));
+
+    /* Go straight to the slot of this backend's newest error */
+    last_seq = pg_atomic_read_u64(&backend_state[MyProcNumber].last_seq);
+    if (last_seq == 0)
+        PG_RETURN_NULL();
+
+    /*
+     * The slot may have been cleared or reused since, and the pointer may
+     * have been left behind by an earlier backend with the same proc number.
+     */
+    if (read_ticket_header(&current_ring, ENTRY_SEQ_TICKET(last_seq),
+                           &latest) != TICKET_READ ||
+        latest.backend_pid != MyProcPid)
+        PG_RETURN_NULL();
+
+    /* Its text may already have been overwritten */
+    if (!read_error_text(&current_ring, &latest, &record))
+        PG_RETURN_NULL();
+
+    /* Build result tuple */
+    error_record_values(&record, values, nulls);
+
+    tuple = heap_form_tuple(tupdesc, values, nulls);
+    PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
+
+/*
+ * SQL function: get_error_history(max_results int, include_previous_run bool)
+ * Returns recent errors across all backends, newest first.  With
+ * include_previous_run, the errors of the previous run follow, if the ring
+ * file kept them.
+ */
+Datum
+get_error_history(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    int32 limit;
+    MemoryContext oldcontext;
+    ErrorHistoryContext *ctx;
+    TupleDesc tupdesc;
+    ErrorRing *previous = NULL;
+    uint64 next_seq;
+    uint64 oldest;
+    uint64 previous_next_seq = 0;
+    uint64 previous_oldest = 0;
+    uint64 ticket;
+
+    if (error_buffer == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        /* The SQL definition from version 1.0 has only the first argument */
+        if (PG_NARGS() > 1 && PG_GETARG_BOOL(1))
+            previous = open_previous_ring();
+
+        limit = PG_GETARG_INT32(0);
+        if (limit <= 0 || limit > llm_helper_max_errors +
+            (previous ? previous->max_errors : 0))
+            limit = llm_helper_max_errors + (previous ? previous->max_errors : 0);
+
+        next_seq = pg_atomic_read_u64(&error_buffer->next_seq);
+        oldest = next_seq > (uint64) llm_helper_max_errors ?
+            next_seq - llm_helper_max_errors : 0;
+        oldest = Max(oldest, pg_atomic_read_u64(&error_buffer->cleared_seq));
+        oldest = Min(oldest, next_seq);
+
+        /*
+         * The previous run, leaving out what was loaded from the dump file
+         * into this one
+         */
+        if (previous != NULL)
+        {
+            previous_next_seq = Min(pg_atomic_read_u64(&previous->buffer->next_seq),
+                                    error_buffer->restored_seq);
+            previous_oldest = previous_next_seq > (uint64) previous->max_errors ?
+                previous_next_seq - previous->max_errors : 0;
+            previous_oldest = Max(previous_oldest,
+                                  pg_atomic_read_u64(&previous->buffer->cleared_seq));
+            previous_oldest = Min(previous_oldest, previous_next_seq);
+        }
+
+        /* Room for no more entries than there are tickets to read */
+        if ((uint64) limit > (next_seq - oldest) +
+            (previous_next_seq - previous_oldest))
+            limit = (next_seq - oldest) + (previous_next_seq - previous_oldest);
+
+        ctx = palloc(sizeof(ErrorHistoryContext));
+        ctx->next_index = 0;
+        ctx->count = 0;
+        ctx->records = palloc_extended(sizeof(ErrorRecord) * Max(limit, 1),
+                                       MCXT_ALLOC_HUGE);
+
+        /*
+         * Walk backward from the newest ticket, copying only the entries we
+         * are going to return.  Ticket order is capture order, so the rows
+         * come out newest first.
+         */
+        for (ticket = next_seq; ticket > oldest && ctx->count < limit; ticket--)
+        {
+            if (read_ticket(&current_ring, ticket - 1,
+                            &ctx->records[ctx->count]) == TICKET_READ)
+                ctx->count++;
+        }
+
+        /*
+         * Then the previous run.  Entries a crash left half-written read as
+         * pending and are skipped.
+         */
+        if (previous != NULL)
+        {
+            for (ticket = previous_next_seq;
+                 ticket > previous_oldest && ctx->count < limit;
+                 ticket--)
+            {
+                if (read_ticket(previous, ticket - 1,
+                                &ctx->records[ctx->count]) == TICKET_READ)
+                    ctx->count++;
+            }
+        }
+
+        funcctx->user_fctx = ctx;
+
+        /* Build tuple descriptor */
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("function returning record called in context that cannot accept type record")));
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    ctx = (ErrorHistoryContext *) funcctx->user_fctx;
+
+    if (ctx->next_index < ctx->count)
+    {
+        ErrorRecord *record = &ctx->records[ctx->next_index++];
+        Datum values[ERROR_RECORD_COLS + 1];
+        bool nulls[ERROR_RECORD_COLS + 1];
+        HeapTuple tuple;
+
+        /* The common columns, then from_previous_run */
+        error_record_values(record, values, nulls);
+        values[ERROR_RECORD_COLS] = BoolGetDatum(record->from_previous_run);
+        nulls[ERROR_RECORD_COLS] = false;
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * SQL function: clear_error_history()
  * Clears all stored errors
  */
 Datum
-clear_error_history(PG_FUNCTION_ARGS)
+clear_error_history(PG_FUNCTION_ARGS)
+{
+    if (error_buffer == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    /*
+     * Start a new epoch: every ticket handed out so far becomes invisible.
+     * Nothing is wiped, so this costs the same however large the buffer is.
+     */
+    pg_atomic_monotonic_advance_u64(&error_buffer->cleared_seq,
+                                    pg_atomic_read_u64(&error_buffer->next_seq));
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * SQL function: get_errors_since(after_seq bigint, max_results int)
+ * Returns errors with a sequence number above after_seq, oldest first.
+ *
+ * Pollers pass the seq of the last row they received to pick up where they
+ * left off.  Each row's "lost" column counts the errors between it and the
+ * previous row (or after_seq) that were overwritten before they could be
+ * read.  Reading stops at the first error that is still being written, so
+ * a cursor never skips past one.
+ */
+Datum
+get_errors_since(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+    ErrorHistoryContext *ctx;
+    TupleDesc tupdesc;
+
+    if (error_buffer == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        int64 after_seq;
+        int32 limit;
+        uint64 next_seq;
+        uint64 ticket;
+        uint64 lost;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        after_seq = PG_GETARG_INT64(0);
+        limit = PG_GETARG_INT32(1);
+        if (limit <= 0 || limit > llm_helper_max_errors)
+            limit = llm_helper_max_errors;
+
+        next_seq = pg_atomic_read_u64(&error_buffer->next_seq);
+        ticket = cursor_first_ticket(after_seq, next_seq, false, &lost);
+
+        /* Room for no more entries than there are tickets to read */
+        if ((uint64) limit > next_seq - Min(ticket, next_seq))
+            limit = next_seq - Min(ticket, next_seq);
+
+        ctx = palloc(sizeof(ErrorHistoryContext));
+        ctx->next_index = 0;
+        ctx->count = 0;
+        ctx->records = palloc_extended(sizeof(ErrorRecord) * Max(limit, 1),
+                                       MCXT_ALLOC_HUGE);
+        ctx->lost = palloc_extended(sizeof(uint64) * Max(limit, 1),
+                                    MCXT_ALLOC_HUGE);
+
+        for (; ticket < next_seq && ctx->count < limit; ticket++)
+        {
+            TicketState state = read_ticket(&current_ring, ticket,
+                                            &ctx->records[ctx->count]);
+
+            if (state == TICKET_PENDING)
+                break;
+            if (state == TICKET_CLEARED)
+                continue;
+            if (state == TICKET_LOST)
+            {
+                lost++;
+                continue;
+            }
+            ctx->lost[ctx->count++] = lost;
+            lost = 0;
+        }
+
+        funcctx->user_fctx = ctx;
+
+        /* Build tuple descriptor */
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("function returning record called in context that cannot accept type record")));
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    ctx = (ErrorHistoryContext *) funcctx->user_fctx;
+
+    if (ctx->next_index < ctx->count)
+    {
+        ErrorRecord *record = &ctx->records[ctx->next_index];
+        Datum values[ERROR_RECORD_COLS + 2];
+        bool nulls[ERROR_RECORD_COLS + 2];
+        HeapTuple tuple;
+
+        /* seq, the common columns, then lost */
+        values[0] = Int64GetDatum((int64) record->seq);
+        nulls[0] = false;
+        error_record_values(record, values + 1, nulls + 1);
+        values[ERROR_RECORD_COLS + 1] =
+            Int64GetDatum((int64) ctx->lost[ctx->next_index]);
+        nulls[ERROR_RECORD_COLS + 1] = false;
+        ctx->next_index++;
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * SQL function: wait_for_error(after_seq bigint, timeout interval)
+ * Sleeps until an error with a sequence number above after_seq has been
+ * captured, or the timeout expires.  Returns false on timeout.
+ */
+Datum
+wait_for_error(PG_FUNCTION_ARGS)
+{
+    int64 after_seq = PG_GETARG_INT64(0);
+    Interval *timeout = PG_GETARG_INTERVAL_P(1);
+    int64 timeout_usecs = interval_to_usecs(timeout);
+    TimestampTz deadline;
+    bool forever;
+    volatile bool found = false;
+
+    if (error_buffer == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    if (timeout_usecs < 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("timeout must not be negative")));
+
+    /* A timeout too long to have a deadline means waiting until an error */
+    forever = pg_add_s64_overflow(GetCurrentTimestamp(), timeout_usecs,
+                                  &deadline);
+
+    if (wait_event_wait_for_error == 0)
+        wait_event_wait_for_error = WaitEventExtensionNew("LlmHelperWaitForError");
+
+    /* Register as a waiter before checking, so no broadcast can be missed */
+    pg_atomic_fetch_add_u32(&error_buffer->num_waiters, 1);
+    PG_TRY();
+    {
+        ConditionVariablePrepareToSleep(&error_buffer->new_error_cv);
+        for (;;)
+        {
+            long remaining = -1;
+
+            if (error_published_since(after_seq))
+            {
+                found = true;
+                break;
+            }
+
+            if (!forever)
+            {
+                remaining = TimestampDifferenceMilliseconds(GetCurrentTimestamp(),
+                                                            deadline);
+                if (remaining <= 0)
+                    break;
+                remaining = Min(remaining, INT_MAX);
+            }
+
+            ConditionVariableTimedSleep(&error_buffer->new_error_cv, remaining,
+                                        wait_event_wait_for_error);
+        }
+        ConditionVariableCancelSleep();
+    }
+    PG_FINALLY();
+    {
+        pg_atomic_fetch_add_u32(&error_buffer->num_waiters, -1);
+    }
+    PG_END_TRY();
+
+    PG_RETURN_BOOL(found);
+}
+
+/*
+ * SQL function: get_error_stats()
+ * Returns the aggregated statistics of every tracked error fingerprint
+ */
+Datum
+get_error_stats(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    ErrorStatsEntry *entries;
+    int count;
+    int i;
+
+    if (error_stats_hash == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    entries = copy_error_stats(&count);
+    for (i = 0; i < count; i++)
+    {
+        ErrorStatsEntry *entry = &entries[i];
+        Datum values[11];
+        bool nulls[11];
+
+        memset(nulls, 0, sizeof(nulls));
+        if (entry->key.queryid != 0)
+            values[0] = Int64GetDatum((int64) entry->key.queryid);
+        else
+            nulls[0] = true;
+        values[1] = CStringGetTextDatum(unpack_sql_state(entry->key.sqlerrcode));
+        values[2] = Int64GetDatum((int64) entry->key.message_hash);
+        values[3] = Int64GetDatum(entry->count);
+        values[4] = Int64GetDatum(hll_estimate(&entry->pids));
+        values[5] = Int64GetDatum(hll_estimate(&entry->roles));
+        values[6] = Int64GetDatum(hll_estimate(&entry->databases));
+        values[7] = TimestampTzGetDatum(entry->first_seen);
+        values[8] = TimestampTzGetDatum(entry->last_seen);
+        values[9] = CStringGetTextDatum(entry->sample_message);
+        values[10] = CStringGetTextDatum(entry->sample_query);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
+
+/*
+ * Copy the statistics entries into local memory, so that the lock is not
+ * held while building tuples
+ */
+static ErrorStatsEntry *
+copy_error_stats(int *count)
+{
+    HASH_SEQ_STATUS hash_seq;
+    ErrorStatsEntry *entry;
+    ErrorStatsEntry *entries;
+    int n = 0;
+
+    LWLockAcquire(error_stats->lock, LW_SHARED);
+
+    entries = palloc_extended(sizeof(ErrorStatsEntry) *
+                              Max(hash_get_num_entries(error_stats_hash), 1),
+                              MCXT_ALLOC_HUGE);
+
+    hash_seq_init(&hash_seq, error_stats_hash);
+    while ((entry = hash_seq_search(&hash_seq)) != NULL)
+    {
+        ErrorStatsEntry *copy = &entries[n++];
+
+        /* The key and samples only change under the exclusive lock */
+        memcpy(copy, entry, sizeof(ErrorStatsEntry));
+
+        /* Copy the counters under the entry's spinlock */
+        SpinLockAcquire(&entry->mutex);
+        copy->count = entry->count;
+        copy->pids = entry->pids;
+        copy->roles = entry->roles;
+        copy->databases = entry->databases;
+        copy->first_seen = entry->first_seen;
+        copy->last_seen = entry->last_seen;
+        copy->rate_minute = entry->rate_minute;
+        copy->rate_count = entry->rate_count;
+        copy->rate_mean = entry->rate_mean;
+        copy->rate_var = entry->rate_var;
+        SpinLockRelease(&entry->mutex);
+    }
+
+    LWLockRelease(error_stats->lock);
+
+    *count = n;
+    return entries;
+}
+
+/*
+ * SQL function: reset_error_stats()
+ * Discards all aggregated error statistics
+ */
+Datum
+reset_error_stats(PG_FUNCTION_ARGS)
+{
+    HASH_SEQ_STATUS hash_seq;
+    ErrorStatsEntry *entry;
+    ErrorObjectEntry *object;
+    int i;
+
+    if (error_stats_hash == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    LWLockAcquire(error_stats->lock, LW_EXCLUSIVE);
+
+    hash_seq_init(&hash_seq, error_stats_hash);
+    while ((entry = hash_seq_search(&hash_seq)) != NULL)
+        hash_search(error_stats_hash, &entry->key, HASH_REMOVE, NULL);
+
+    hash_seq_init(&hash_seq, error_objects_hash);
+    while ((object = hash_seq_search(&hash_seq)) != NULL)
+        hash_search(error_objects_hash, &object->key, HASH_REMOVE, NULL);
+
+    LWLockRelease(error_stats->lock);
+
+    for (i = 0; i < SQLSTATE_CLASSES; i++)
+    {
+        ErrorClassStats *class = &error_stats->classes[i];
+
+        SpinLockAcquire(&class->mutex);
+        class->count = 0;
+        memset(&class->pids, 0, sizeof(HyperLogLog));
+        memset(&class->roles, 0, sizeof(HyperLogLog));
+        memset(&class->databases, 0, sizeof(HyperLogLog));
+        memset(&class->queryids, 0, sizeof(HyperLogLog));
+        SpinLockRelease(&class->mutex);
+    }
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * SQL function: top_errors(k int)
+ * Returns the k most frequent errors since server start, most frequent
+ * first, with their estimated number of occurrences
+ */
+Datum
+top_errors(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    int32 limit = PG_GETARG_INT32(0);
+    TopErrorCandidate *candidates;
+    TopErrorRow *rows;
+    int count;
+    int i;
+
+    if (error_sketch == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    if (limit <= 0 || limit > TOP_ERRORS_CANDIDATES)
+        limit = TOP_ERRORS_CANDIDATES;
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    candidates = palloc(sizeof(TopErrorCandidate) * TOP_ERRORS_CANDIDATES);
+    rows = palloc(sizeof(TopErrorRow) * TOP_ERRORS_CANDIDATES);
+
+    /* Writers hold the flag only briefly, and never wait for it */
+    while (!pg_atomic_test_set_flag(&error_sketch->candidates_lock))
+        pg_spin_delay();
+    count = error_sketch->num_candidates;
+    memcpy(candidates, error_sketch->candidates,
+           sizeof(TopErrorCandidate) * count);
+    pg_atomic_clear_flag(&error_sketch->candidates_lock);
+
+    /* Rank them by their current estimates */
+    for (i = 0; i < count; i++)
+    {
+        rows[i].estimate = sketch_estimate(candidates[i].fingerprint);
+        rows[i].index = i;
+    }
+    qsort(rows, count, sizeof(TopErrorRow), top_error_cmp);
+
+    for (i = 0; i < count && i < limit; i++)
+    {
+        TopErrorCandidate *candidate = &candidates[rows[i].index];
+        Datum values[5];
+        bool nulls[5];
+
+        memset(nulls, 0, sizeof(nulls));
+        if (candidate->key.queryid != 0)
+            values[0] = Int64GetDatum((int64) candidate->key.queryid);
+        else
+            nulls[0] = true;
+        values[1] = CStringGetTextDatum(unpack_sql_state(candidate->key.sqlerrcode));
+        values[2] = Int64GetDatum((int64) candidate->key.message_hash);
+        values[3] = Int64GetDatum((int64) rows[i].estimate);
+        values[4] = CStringGetTextDatum(candidate->sample_message);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
+
+/*
+ * SQL function: get_error_rate(since interval)
+ * Returns the number of errors per minute over the given interval back from
+ * now, oldest minute first, one row for each error level and SQLSTATE class
+ * that occurred in it.  Covers at most the last day.
+ */
+Datum
+get_error_rate(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    int64 since_usecs = interval_to_usecs(PG_GETARG_INTERVAL_P(0));
+    static const char *const level_names[RATE_LEVELS] = {"ERROR", "FATAL", "PANIC"};
+    int64 current;
+    int64 minutes;
+    int64 minute;
+
+    if (error_rates == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    if (since_usecs < 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("interval must not be negative")));
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    /* The current, partial minute counts too */
+    current = GetCurrentTimestamp() / USECS_PER_MINUTE;
+    minutes = Min(since_usecs / USECS_PER_MINUTE + 1, RATE_BUCKETS);
+
+    for (minute = current - minutes + 1; minute <= current; minute++)
+    {
+        ErrorRateBucket *bucket = &error_rates[minute % RATE_BUCKETS];
+        uint32 counts[RATE_LEVELS][SQLSTATE_CLASSES];
+        int i;
+        int j;
+
+        /* Copy the counts, and check the bucket still covers this minute */
+        if (pg_atomic_read_u64(&bucket->minute) != RATE_MINUTE(minute))
+            continue;
+        pg_read_barrier();
+        for (i = 0; i < RATE_LEVELS; i++)
+            for (j = 0; j < SQLSTATE_CLASSES; j++)
+                counts[i][j] = pg_atomic_read_u32(&bucket->counts[i][j]);
+        pg_read_barrier();
+        if (pg_atomic_read_u64(&bucket->minute) != RATE_MINUTE(minute))
+            continue;
+
+        for (i = 0; i < RATE_LEVELS; i++)
+        {
+            for (j = 0; j < SQLSTATE_CLASSES; j++)
+            {
+                Datum values[4];
+                bool nulls[4];
+
+                if (counts[i][j] == 0)
+                    continue;
+
+                memset(nulls, 0, sizeof(nulls));
+                values[0] = TimestampTzGetDatum((TimestampTz) minute * USECS_PER_MINUTE);
+                values[1] = CStringGetTextDatum(level_names[i]);
+                values[2] = CStringGetTextDatum(j < lengthof(sqlstate_classes) ?
+                                                sqlstate_classes[j] : "other");
+                values[3] = Int64GetDatum((int64) counts[i][j]);
+
+                tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc,
+                                     values, nulls);
+            }
+        }
+    }
+
+    return (Datum) 0;
+}
+
+/*
+ * SQL function: get_error_class_stats()
+ * Returns the number of errors in each SQLSTATE class, and how many
+ * distinct backends, roles, databases and queries they came from
+ */
+Datum
+get_error_class_stats(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    int i;
+
+    if (error_stats == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    for (i = 0; i < SQLSTATE_CLASSES; i++)
+    {
+        ErrorClassStats *class = &error_stats->classes[i];
+        ErrorClassStats copy;
+        Datum values[6];
+        bool nulls[6];
+
+        SpinLockAcquire(&class->mutex);
+        copy = *class;
+        SpinLockRelease(&class->mutex);
+
+        if (copy.count == 0)
+            continue;
+
+        memset(nulls, 0, sizeof(nulls));
+        values[0] = CStringGetTextDatum(i < lengthof(sqlstate_classes) ?
+                                        sqlstate_classes[i] : "other");
+        values[1] = Int64GetDatum(copy.count);
+        values[2] = Int64GetDatum(hll_estimate(&copy.pids));
+        values[3] = Int64GetDatum(hll_estimate(&copy.roles));
+        values[4] = Int64GetDatum(hll_estimate(&copy.databases));
+        values[5] = Int64GetDatum(hll_estimate(&copy.queryids));
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
+
+/*
+ * SQL function: get_error_object_stats()
+ * Returns the number of errors about each table and constraint
+ */
+Datum
+get_error_object_stats(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    ErrorObjectEntry *entries;
+    int count;
+    int i;
+
+    if (error_objects_hash == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    entries = copy_error_objects(&count);
+    for (i = 0; i < count; i++)
+    {
+        ErrorObjectEntry *entry = &entries[i];
+        Datum values[8];
+        bool nulls[8];
+
+        memset(nulls, 0, sizeof(nulls));
+        values[0] = ObjectIdGetDatum(entry->key.dbid);
+        if (entry->key.schema_name[0] != '\0')
+            values[1] = CStringGetTextDatum(entry->key.schema_name);
+        else
+            nulls[1] = true;
+        if (entry->key.table_name[0] != '\0')
+            values[2] = CStringGetTextDatum(entry->key.table_name);
+        else
+            nulls[2] = true;
+        if (entry->key.constraint_name[0] != '\0')
+            values[3] = CStringGetTextDatum(entry->key.constraint_name);
+        else
+            nulls[3] = true;
+        values[4] = CStringGetTextDatum(unpack_sql_state(entry->key.sqlerrcode));
+        values[5] = Int64GetDatum(entry->count);
+        values[6] = TimestampTzGetDatum(entry->first_seen);
+        values[7] = TimestampTzGetDatum(entry->last_seen);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
+
+/*
+ * Copy the object statistics into local memory, like copy_error_stats
+ */
+static ErrorObjectEntry *
+copy_error_objects(int *count)
+{
+    HASH_SEQ_STATUS hash_seq;
+    ErrorObjectEntry *entry;
+    ErrorObjectEntry *entries;
+    int n = 0;
+
+    LWLockAcquire(error_stats->lock, LW_SHARED);
+
+    entries = palloc_extended(sizeof(ErrorObjectEntry) *
+                              Max(hash_get_num_entries(error_objects_hash), 1),
+                              MCXT_ALLOC_HUGE);
+
+    hash_seq_init(&hash_seq, error_objects_hash);
+    while ((entry = hash_seq_search(&hash_seq)) != NULL)
+    {
+        ErrorObjectEntry *copy = &entries[n++];
+
+        copy->key = entry->key;
+        SpinLockAcquire(&entry->mutex);
+        copy->count = entry->count;
+        copy->first_seen = entry->first_seen;
+        copy->last_seen = entry->last_seen;
+        SpinLockRelease(&entry->mutex);
+    }
+
+    LWLockRelease(error_stats->lock);
+
+    *count = n;
+    return entries;
+}
+
+/*
+ * SQL function: get_error_spikes(sigma float8)
+ * Returns the fingerprints whose errors per minute, in the current or the
+ * previous minute, are at least sigma standard deviations above their
+ * moving average.  The standard deviation is taken to be at least one error
+ * per minute, so a steady or brand new error needs a few more errors than
+ * usual to count as a spike.
+ */
+Datum
+get_error_spikes(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    double threshold = PG_GETARG_FLOAT8(0);
+    ErrorStatsEntry *entries;
+    int count;
+    int64 current;
+    int i;
+
+    if (error_stats_hash == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_llm_helper shared memory not initialized")));
+
+    if (isnan(threshold))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("sigma must not be NaN")));
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    current = GetCurrentTimestamp() / USECS_PER_MINUTE;
+
+    entries = copy_error_stats(&count);
+    for (i = 0; i < count; i++)
+    {
+        ErrorStatsEntry *entry = &entries[i];
+        Datum values[9];
+        bool nulls[9];
+        int64 rate_minute = entry->rate_minute;
+        int64 rate_count = entry->rate_count;
+        double rate_mean = entry->rate_mean;
+        double rate_var = entry->rate_var;
+        double stddev;
+        double sigma;
+
+        /* No errors in the last two minutes, so nothing out of the ordinary */
+        if (rate_minute < current - 1)
+            continue;
+
+        stddev = Max(sqrt(rate_var), 1.0);
+        sigma = ((double) rate_count - rate_mean) / stddev;
+        if (sigma < threshold)
+            continue;
+
+        memset(nulls, 0, sizeof(nulls));
+        if (entry->key.queryid != 0)
+            values[0] = Int64GetDatum((int64) entry->key.queryid);
+        else
+            nulls[0] = true;
+        values[1] = CStringGetTextDatum(unpack_sql_state(entry->key.sqlerrcode));
+        values[2] = Int64GetDatum((int64) entry->key.message_hash);
+        values[3] = TimestampTzGetDatum((TimestampTz) rate_minute * USECS_PER_MINUTE);
+        values[4] = Int64GetDatum(rate_count);
+        values[5] = Float8GetDatum(rate_mean);
+        values[6] = Float8GetDatum(sqrt(rate_var));
+        values[7] = Float8GetDatum(sigma);
+        values[8] = CStringGetTextDatum(entry->sample_message);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
+
+/*
+ * Register the background worker that saves captured errors to
+ * pg_llm_error_log
+ */
+static void
+register_persist_worker(void)
+{
+    BackgroundWorker worker;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+        BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = 10;
+    strlcpy(worker.bgw_library_name, "pg_llm_helper", BGW_MAXLEN);
+    strlcpy(worker.bgw_function_name, "llm_helper_persist_main", BGW_MAXLEN);
+    strlcpy(worker.bgw_name, "pg_llm_helper persist", BGW_MAXLEN);
+    strlcpy(worker.bgw_type, "pg_llm_helper persist", BGW_MAXLEN);
+
+    RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Main loop of the persist worker.  Every persist_interval it copies the
+ * errors captured since its cursor into pg_llm_error_log, in one
+ * transaction, and once a minute it drops the partitions that have expired.
+ * If that fails, the worker exits and is restarted by the postmaster; the
+ * cursor is in shared memory, so nothing is skipped.
+ */
+void
+llm_helper_persist_main(Datum main_arg)
+{
+    TimestampTz last_expired = 0;
+
+    is_persist_worker = true;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    BackgroundWorkerInitializeConnection(llm_helper_persist_database, NULL, 0);
+
+    wait_event_persist = WaitEventExtensionNew("LlmHelperPersist");
+
+    for (;;)
+    {
+        (void) WaitLatch(MyLatch,
+                         WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                         llm_helper_persist_interval,
+                         wait_event_persist);
+        ResetLatch(MyLatch);
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        persist_errors();
+
+        if (TimestampDifferenceExceeds(last_expired, GetCurrentTimestamp(),
+                                       60 * 1000))
+        {
+            expire_partitions();
+            last_expired = GetCurrentTimestamp();
+        }
+    }
+}
+
+/*
+ * Schema of pg_llm_error_log, which belongs to the extension wherever it
+ * was installed.  InvalidOid if the extension isn't installed in this
+ * database, or is still at a version without the table, which is logged
+ * once.  Must be called in a transaction.
+ */
+static Oid
+persist_schema(void)
+{
+    static bool warned_missing = false;
+    static bool warned_no_table = false;
+    Oid extension_oid;
+    Oid schema;
+
+    extension_oid = get_extension_oid("pg_llm_helper", true);
+    if (!OidIsValid(extension_oid))
+    {
+        if (!warned_missing)
+            ereport(LOG,
+                    (errmsg("pg_llm_helper extension is not installed in database \"%s\", captured errors are not being saved",
+                            llm_helper_persist_database)));
+        warned_missing = true;
+        return InvalidOid;
+    }
+    warned_missing = false;
+
+    schema = get_extension_schema(extension_oid);
+    if (!OidIsValid(get_relname_relid("pg_llm_error_log", schema)))
+    {
+        if (!warned_no_table)
+            ereport(LOG,
+                    (errmsg("table pg_llm_error_log does not exist in database \"%s\", captured errors are not being saved",
+                            llm_helper_persist_database),
+                     errhint("Update the extension with ALTER EXTENSION pg_llm_helper UPDATE.")));
+        warned_no_table = true;
+        return InvalidOid;
+    }
+    warned_no_table = false;
+
+    return schema;
+}
+
+/*
+ * Copy the errors captured since the worker's cursor into pg_llm_error_log,
+ * using one prepared insert for the whole batch.  The cursor only advances
+ * once the batch has been committed.
+ */
+static void
+persist_errors(void)
+{
+    Oid argtypes[] = {
+        INT8OID, INT4OID, TEXTOID, TEXTOID, TEXTOID, INT4OID, TIMESTAMPTZOID,
+        INT8OID, INT8OID, INT8OID, TIMESTAMPTZOID,
+        TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID
+    };
+    Oid schema;
+    const char *schema_name;
+    StringInfoData sql;
+    SPIPlanPtr plan;
+    TimestampTz partition_start = 0;
+    TimestampTz partition_end = 0;
+    uint64 next_seq;
+    uint64 ticket;
+    uint64 lost;
+    uint64 saved = 0;
+    int i;
+
+    StaticAssertStmt(lengthof(argtypes) == ERROR_RECORD_COLS + 1,
+                     "argtypes must match seq and error_record_values");
+
+    next_seq = pg_atomic_read_u64(&error_buffer->next_seq);
+    ticket = cursor_first_ticket((int64) pg_atomic_read_u64(&error_buffer->drained_seq),
+                                 next_seq, true, &lost);
+    if (ticket >= next_seq && lost == 0)
+        return;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "saving captured errors");
+
+    schema = persist_schema();
+    if (!OidIsValid(schema))
+    {
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+        pgstat_report_activity(STATE_IDLE, NULL);
+        return;
+    }
+    schema_name = quote_identifier(get_namespace_name(schema));
+
+    initStringInfo(&sql);
+    appendStringInfo(&sql,
+                     "INSERT INTO %s.pg_llm_error_log (seq, backend_pid, query_text, error_message, sql_state, error_level, \"timestamp\", message_hash, queryid, repeat_count, last_seen, schema_name, table_name, column_name, constraint_name, datatype_name) "
+                     "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14, $15, $16)",
+                     schema_name);
+    plan = SPI_prepare(sql.data, lengthof(argtypes), argtypes);
+    if (plan == NULL)
+        elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+
+    /* One lap of the ring at most, so the batch stays bounded */
+    for (; ticket < next_seq && saved < (uint64) llm_helper_max_errors; ticket++)
+    {
+        ErrorEntry header;
+        ErrorRecord record;
+        Datum values[ERROR_RECORD_COLS + 1];
+        bool isnull[ERROR_RECORD_COLS + 1];
+        char nulls[ERROR_RECORD_COLS + 1];
+        TicketState state;
+        int ret;
+
+        /* clear_error_history() hides errors from users, not from the log */
+        state = read_slot_header(&current_ring, ticket, &header);
+        if (state == TICKET_READ &&
+            !read_error_text(&current_ring, &header, &record))
+            state = TICKET_LOST;
+
+        if (state == TICKET_PENDING)
+            break;
+        if (state == TICKET_LOST)
+        {
+            lost++;
+            continue;
+        }
+
+        values[0] = Int64GetDatum((int64) record.seq);
+        isnull[0] = false;
+        error_record_values(&record, values + 1, isnull + 1);
+        for (i = 0; i < lengthof(nulls); i++)
+            nulls[i] = isnull[i] ? 'n' : ' ';
+
+        /* Errors come mostly in time order, so this rarely has work to do */
+        if (record.timestamp < partition_start ||
+            record.timestamp >= partition_end)
+            ensure_partition(schema, schema_name, record.timestamp,
+                             &partition_start, &partition_end);
+
+        ret = SPI_execute_plan(plan, values, nulls, false, 0);
+        if (ret != SPI_OK_INSERT)
+            elog(ERROR, "could not save captured error: %s",
+                 SPI_result_code_string(ret));
+
+        pfree(record.error_message);
+        saved++;
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    pgstat_report_activity(STATE_IDLE, NULL);
+
+    pg_atomic_write_u64(&error_buffer->drained_seq, ticket);
+
+    if (lost > 0)
+        ereport(LOG,
+                (errmsg("pg_llm_helper could not save %llu captured errors because they were overwritten first",
+                        (unsigned long long) lost),
+                 errhint("Decrease \"pg_llm_helper.persist_interval\" or increase \"pg_llm_helper.max_errors\".")));
+}
+
+/*
+ * Make sure pg_llm_error_log has a partition for timestamp, and return the
+ * range that partition covers.  Partitions are named after the UTC day, or
+ * day and hour, they start at.
+ *
+ * A partition of the other size may already cover the timestamp, if
+ * partition_by was changed.  After switching from hours to days, the rest
+ * of the day keeps getting hourly partitions, as a daily one would overlap.
+ */
+static void
+ensure_partition(Oid schema, const char *schema_name, TimestampTz timestamp,
+                 TimestampTz *start, TimestampTz *end)
+{
+    int64 hour = floor_div(timestamp, USECS_PER_HOUR);
+    int64 day_start = floor_div(hour, 24) * 24;
+    char name[NAMEDATALEN];
+    char from[64];
+    char to[64];
+    Oid parent = get_relname_relid("pg_llm_error_log", schema);
+    bool hourly;
+    int64 first;
+    int64 last;
+    int i;
+    int ret;
+
+    partition_name(day_start, false, name);
+    if (partition_exists(name, schema, parent))
+    {
+        *start = day_start * USECS_PER_HOUR;
+        *end = (day_start + 24) * USECS_PER_HOUR;
+        return;
+    }
+
+    partition_name(hour, true, name);
+    if (partition_exists(name, schema, parent))
+    {
+        *start = hour * USECS_PER_HOUR;
+        *end = (hour + 1) * USECS_PER_HOUR;
+        return;
+    }
+
+    hourly = (llm_helper_partition_by == PARTITION_BY_HOUR);
+    for (i = 0; i < 24 && !hourly; i++)
+    {
+        partition_name(day_start + i, true, name);
+        if (partition_exists(name, schema, parent))
+            hourly = true;
+    }
+
+    first = hourly ? hour : day_start;
+    last = first + (hourly ? 1 : 24);
+    partition_name(first, hourly, name);
+    partition_bound(first, from, sizeof(from));
+    partition_bound(last, to, sizeof(to));
+
+    ret = SPI_execute(psprintf("CREATE TABLE %s.%s PARTITION OF %s.pg_llm_error_log FOR VALUES FROM (%s) TO (%s)",
+                               schema_name, quote_identifier(name),
+                               schema_name, from, to),
+                      false, 0);
+    if (ret != SPI_OK_UTILITY)
+        elog(ERROR, "could not create partition \"%s\": %s",
+             name, SPI_result_code_string(ret));
+
+    *start = first * USECS_PER_HOUR;
+    *end = last * USECS_PER_HOUR;
+}
+
+/*
+ * Is there a partition of parent called name?  Anything else by that name
+ * would keep the partition from being created, which is an error.
+ */
+static bool
+partition_exists(const char *name, Oid schema, Oid parent)
+{
+    Oid relid = get_relname_relid(name, schema);
+
+    if (!OidIsValid(relid))
+        return false;
+
+    if (!get_rel_relispartition(relid) ||
+        get_partition_parent(relid, true) != parent)
+        ereport(ERROR,
+                (errcode(ERRCODE_DUPLICATE_TABLE),
+                 errmsg("relation \"%s\" already exists but is not a partition of pg_llm_error_log",
+                        name),
+                 errhint("Attach it to pg_llm_error_log, or rename or drop it.")));
+
+    return true;
+}
+
+/*
+ * Drop the partitions of pg_llm_error_log whose errors are all older than
+ * the retention period, in one transaction
+ */
+static void
+expire_partitions(void)
+{
+    TimestampTz cutoff;
+    Oid schema;
+    Oid parent;
+    SPITupleTable *partitions;
+    uint64 count;
+    uint64 i;
+    int ret;
+
+    if (llm_helper_retention == 0)
+        return;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "dropping expired partitions");
+
+    schema = persist_schema();
+    parent = OidIsValid(schema) ?
+        get_relname_relid("pg_llm_error_log", schema) : InvalidOid;
+    if (OidIsValid(parent))
+    {
+        cutoff = GetCurrentTimestamp() -
+            (TimestampTz) llm_helper_retention * USECS_PER_MINUTE;
+
+        ret = SPI_execute(psprintf("SELECT c.relname FROM pg_catalog.pg_inherits i JOIN pg_catalog.pg_class c ON c.oid = i.inhrelid WHERE i.inhparent = %u",
+                                   parent),
+                          true, 0);
+        if (ret != SPI_OK_SELECT)
+            elog(ERROR, "could not list partitions: %s",
+                 SPI_result_code_string(ret));
+
+        /* The DROPs below replace SPI_tuptable, but don't free it */
+        partitions = SPI_tuptable;
+        count = SPI_processed;
+        for (i = 0; i < count; i++)
+        {
+            char *name = SPI_getvalue(partitions->vals[i],
+                                      partitions->tupdesc, 1);
+            int year;
+            int month;
+            int day;
+            int hour = -1;
+            int len = 0;
+            int hour_len = 0;
+            int64 end;
+
+            /* Leave alone anything we didn't create */
+            if (sscanf(name, "pg_llm_error_log_p%4d%2d%2d%n",
+                       &year, &month, &day, &len) != 3)
+                continue;
+            if (name[len] == '_' &&
+                sscanf(name + len, "_%2d%n", &hour, &hour_len) == 1)
+                len += hour_len;
+            if (name[len] != '\0')
+                continue;
+
+            end = (int64) (date2j(year, month, day) - POSTGRES_EPOCH_JDATE) * 24;
+            end += hour >= 0 ? hour + 1 : 24;
+            if (end * USECS_PER_HOUR > cutoff)
+                continue;
+
+            ret = SPI_execute(psprintf("DROP TABLE %s.%s",
+                                       quote_identifier(get_namespace_name(schema)),
+                                       quote_identifier(name)),
+                              false, 0);
+            if (ret != SPI_OK_UTILITY)
+                elog(ERROR, "could not drop partition \"%s\": %s",
+                     name, SPI_result_code_string(ret));
+            ereport(DEBUG1,
+                    (errmsg("dropped expired partition \"%s\"", name)));
+        }
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/*
+ * Name of the partition starting at the given hour since the epoch
+ */
+static void
+partition_name(int64 hour, bool hourly, char *name)
+{
+    int64 day = floor_div(hour, 24);
+    int year;
+    int month;
+    int mday;
+
+    j2date((int) (day + POSTGRES_EPOCH_JDATE), &year, &month, &mday);
+    if (hourly)
+        snprintf(name, NAMEDATALEN, "pg_llm_error_log_p%04d%02d%02d_%02d",
+                 year, month, mday, (int) (hour - day * 24));
+    else
+        snprintf(name, NAMEDATALEN, "pg_llm_error_log_p%04d%02d%02d",
+                 year, month, mday);
+}
+
+/*
+ * Partition bound literal for the given hour since the epoch, in UTC so
+ * that it doesn't depend on the TimeZone setting
+ */
+static void
+partition_bound(int64 hour, char *bound, Size size)
+{
+    int64 day = floor_div(hour, 24);
+    int year;
+    int month;
+    int mday;
+
+    j2date((int) (day + POSTGRES_EPOCH_JDATE), &year, &month, &mday);
+    snprintf(bound, size, "'%04d-%02d-%02d %02d:00:00+00'",
+             year, month, mday, (int) (hour - day * 24));
+}
+
+/*
+ * Division rounding towards minus infinity, for timestamps before 2000
+ */
+static int64
+floor_div(int64 value, int64 divisor)
+{
+    int64 quotient = value / divisor;
+
+    if (value % divisor < 0)
+        quotient--;
+    return quotient;
+}
+
+/*
+ * SQL function: export_error_snapshot(path text, compress bool, node_name text)
+ * Writes the errors in the buffer to an error snapshot file, and returns
+ * how many there were.  They are labeled with node_name, which defaults to
+ * cluster_name, or else the system identifier.  Standbys share the system
+ * identifier of their primary, so set one of the others to tell them apart.
+ */
+Datum
+export_error_snapshot(PG_FUNCTION_ARGS)
 {
+    char *path;
+    bool compress;
+    char *node_name;
+    SnapshotRecord *records;
+    int64 count = 0;
+    uint64 next_seq;
+    uint64 lost;
+    uint64 ticket;
+
     if (error_buffer == NULL)
         ereport(ERROR,
                 (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
                  errmsg("pg_llm_helper shared memory not initialized")));
 
-    LWLockAcquire(error_buffer->lock, LW_EXCLUSIVE);
-    
-    error_buffer->current_index = 0;
-    error_buffer->total_errors = 0;
-    memset(error_buffer->errors, 0, sizeof(error_buffer->errors));
-    
-    LWLockRelease(error_buffer->lock);
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+        PG_RETURN_NULL();
+    path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    compress = PG_GETARG_BOOL(1);
+    snapshot_check_access(path, true);
+
+    if (!PG_ARGISNULL(2))
+        node_name = text_to_cstring(PG_GETARG_TEXT_PP(2));
+    else if (cluster_name[0] != '\0')
+        node_name = cluster_name;
+    else
+        node_name = psprintf(UINT64_FORMAT, GetSystemIdentifier());
 
-    PG_RETURN_VOID();
+    next_seq = pg_atomic_read_u64(&error_buffer->next_seq);
+    ticket = cursor_first_ticket(0, next_seq, false, &lost);
+    records = palloc_extended(sizeof(SnapshotRecord) *
+                              Max(next_seq - Min(ticket, next_seq), 1),
+                              MCXT_ALLOC_HUGE);
+    for (; ticket < next_seq; ticket++)
+    {
+        if (read_ticket(&current_ring, ticket, &records[count].error) == TICKET_READ)
+            records[count++].node_name = node_name;
+    }
+
+    write_snapshot(path, records, count, compress);
+
+    PG_RETURN_INT64(count);
+}
+
+/*
+ * SQL function: import_error_snapshot(path text)
+ * Returns the errors in an error snapshot file
+ */
+Datum
+import_error_snapshot(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    char *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    SnapshotRecord *records;
+    int64 count;
+    int64 i;
+
+    snapshot_check_access(path, false);
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    records = read_snapshot(path, &count);
+    for (i = 0; i < count; i++)
+    {
+        Datum values[ERROR_RECORD_COLS + 2];
+        bool nulls[ERROR_RECORD_COLS + 2];
+
+        /* node_name, seq, then the common columns */
+        values[0] = CStringGetTextDatum(records[i].node_name);
+        nulls[0] = false;
+        values[1] = Int64GetDatum((int64) records[i].error.seq);
+        nulls[1] = false;
+        error_record_values(&records[i].error, values + 2, nulls + 2);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
+
+/*
+ * SQL function: merge_error_snapshots(paths text[], path text, compress bool)
+ * Combines error snapshot files into one, in time order, and returns the
+ * number of errors in it.  An error that is in more than one of them, as
+ * identified by its node, sequence number and timestamp, is kept once.
+ * The timestamp is part of that because sequence numbers start over after
+ * a crash.
+ */
+Datum
+merge_error_snapshots(PG_FUNCTION_ARGS)
+{
+    ArrayType *paths = PG_GETARG_ARRAYTYPE_P(0);
+    char *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    bool compress = PG_GETARG_BOOL(2);
+    Datum *elems;
+    bool *elem_nulls;
+    int num_paths;
+    SnapshotRecord *merged = NULL;
+    int64 count = 0;
+    int64 kept;
+    int64 i;
+    int j;
+
+    snapshot_check_access(path, true);
+
+    deconstruct_array_builtin(paths, TEXTOID, &elems, &elem_nulls, &num_paths);
+    for (j = 0; j < num_paths; j++)
+    {
+        SnapshotRecord *records;
+        int64 n;
+        char *input;
+
+        if (elem_nulls[j])
+            continue;
+        input = TextDatumGetCString(elems[j]);
+        snapshot_check_access(input, false);
+
+        records = read_snapshot(input, &n);
+        if (n == 0)
+            continue;
+        if (merged == NULL)
+            merged = palloc_extended(sizeof(SnapshotRecord) * n, MCXT_ALLOC_HUGE);
+        else
+            merged = repalloc_huge(merged, sizeof(SnapshotRecord) * (count + n));
+        memcpy(merged + count, records, sizeof(SnapshotRecord) * n);
+        count += n;
+    }
+
+    /* Sort duplicates next to each other and keep the first of each */
+    kept = 0;
+    if (count > 0)
+    {
+        qsort(merged, count, sizeof(SnapshotRecord), snapshot_key_cmp);
+        for (i = 0; i < count; i++)
+        {
+            if (kept > 0 && snapshot_key_cmp(&merged[kept - 1], &merged[i]) == 0)
+                continue;
+            merged[kept++] = merged[i];
+        }
+        qsort(merged, kept, sizeof(SnapshotRecord), snapshot_time_cmp);
+    }
+
+    write_snapshot(path, merged, kept, compress);
+
+    PG_RETURN_INT64(kept);
+}
+
+/*
+ * Error snapshots are read and written by the server, so like COPY to or
+ * from a file, they need the privileges of pg_read_server_files or
+ * pg_write_server_files, and an absolute path
+ */
+static void
+snapshot_check_access(const char *path, bool write)
+{
+    if (!is_absolute_path(path))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_NAME),
+                 errmsg("relative path not allowed for error snapshots")));
+
+    if (write && !has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES))
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("permission denied to write error snapshot files"),
+                 errdetail("Only roles with privileges of the \"%s\" role may write error snapshot files.",
+                           "pg_write_server_files")));
+
+    if (!write && !has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES))
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("permission denied to read error snapshot files"),
+                 errdetail("Only roles with privileges of the \"%s\" role may read error snapshot files.",
+                           "pg_read_server_files")));
+}
+
+/*
+ * Write records to an error snapshot file, compressed if asked to and if
+ * that makes it smaller
+ */
+static void
+write_snapshot(const char *path, SnapshotRecord *records, int64 count,
+               bool compress)
+{
+    StringInfoData body;
+    StringInfoData record;
+    StringInfoData header;
+    char *stored;
+    int32 stored_len;
+    uint32 flags = 0;
+    pg_crc32c crc;
+    FILE *file;
+    int64 i;
+    int j;
+
+    initStringInfo(&body);
+    initStringInfo(&record);
+    for (i = 0; i < count; i++)
+    {
+        ErrorRecord *error = &records[i].error;
+
+        resetStringInfo(&record);
+        pq_sendint64(&record, error->seq);
+        pq_sendint32(&record, error->backend_pid);
+        pq_sendbytes(&record, error->sql_state, sizeof(error->sql_state));
+        pq_sendint32(&record, error->error_level);
+        pq_sendint64(&record, error->message_hash);
+        pq_sendint64(&record, error->queryid);
+        pq_sendint64(&record, error->timestamp);
+        pq_sendint32(&record, error->repeat_count);
+        pq_sendint64(&record, error->last_seen);
+        snapshot_append_text(&record, records[i].node_name);
+        snapshot_append_text(&record, error->error_message);
+        snapshot_append_text(&record, error->query_text);
+        for (j = 0; j < ERROR_OBJECT_NAMES; j++)
+            snapshot_append_text(&record, error->object_names[j]);
+
+        /* The body has to fit in a StringInfo, and pglz takes an int32 */
+        if ((Size) body.len + sizeof(uint32) + record.len >= MaxAllocSize)
+            ereport(ERROR,
+                    (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                     errmsg("error snapshot \"%s\" would be larger than 1GB",
+                            path)));
+
+        pq_sendint32(&body, record.len);
+        pq_sendbytes(&body, record.data, record.len);
+    }
+
+    stored = body.data;
+    stored_len = body.len;
+    if (compress && body.len > 0)
+    {
+        char *compressed = palloc_extended(PGLZ_MAX_OUTPUT(body.len),
+                                           MCXT_ALLOC_HUGE);
+        int32 len = pglz_compress(body.data, body.len, compressed,
+                                  PGLZ_strategy_always);
+
+        /* Keep it as it is if it doesn't compress */
+        if (len >= 0 && len < body.len)
+        {
+            stored = compressed;
+            stored_len = len;
+            flags |= SNAPSHOT_COMPRESSED;
+        }
+    }
+
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, stored, stored_len);
+    FIN_CRC32C(crc);
+
+    initStringInfo(&header);
+    pq_sendint32(&header, SNAPSHOT_MAGIC);
+    pq_sendint32(&header, SNAPSHOT_VERSION);
+    pq_sendint32(&header, flags);
+    pq_sendint32(&header, crc);
+    pq_sendint64(&header, body.len);
+    pq_sendint64(&header, stored_len);
+    pq_sendint64(&header, count);
+
+    file = AllocateFile(path, PG_BINARY_W);
+    if (file == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open file \"%s\" for writing: %m", path)));
+
+    if (fwrite(header.data, header.len, 1, file) != 1 ||
+        (stored_len > 0 && fwrite(stored, stored_len, 1, file) != 1))
+    {
+        int save_errno = errno;
+
+        FreeFile(file);
+        errno = save_errno;
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", path)));
+    }
+
+    if (FreeFile(file))
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", path)));
+}
+
+/*
+ * Append a length-prefixed string, or the marker for NULL, to a snapshot
+ * record
+ */
+static void
+snapshot_append_text(StringInfo buf, const char *text)
+{
+    if (text == NULL)
+    {
+        pq_sendint32(buf, SNAPSHOT_NULL_TEXT);
+        return;
+    }
+
+    pq_sendint32(buf, strlen(text));
+    pq_sendbytes(buf, text, strlen(text));
+}
+
+/*
+ * Read all the records of an error snapshot file.  The checksum is checked
+ * before anything is parsed.
+ */
+static SnapshotRecord *
+read_snapshot(const char *path, int64 *count)
+{
+    FILE *file;
+    struct stat st;
+    char *data;
+    StringInfoData header;
+    StringInfoData body;
+    uint32 flags;
+    pg_crc32c crc;
+    pg_crc32c file_crc;
+    uint64 raw_len;
+    uint64 stored_len;
+    uint64 num_records;
+    char *raw;
+    SnapshotRecord *records;
+    uint64 i;
+    int j;
+
+    file = AllocateFile(path, PG_BINARY_R);
+    if (file == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open file \"%s\" for reading: %m", path)));
+
+    if (fstat(fileno(file), &st) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not stat file \"%s\": %m", path)));
+
+    if (st.st_size < SNAPSHOT_HEADER_SIZE ||
+        st.st_size > SNAPSHOT_HEADER_SIZE + MaxAllocSize)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("file \"%s\" is not an error snapshot", path)));
+
+    data = palloc_extended(st.st_size, MCXT_ALLOC_HUGE);
+    if (fread(data, st.st_size, 1, file) != 1)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not read file \"%s\": %m", path)));
+    FreeFile(file);
+
+    initReadOnlyStringInfo(&header, data, SNAPSHOT_HEADER_SIZE);
+    if (pq_getmsgint(&header, 4) != SNAPSHOT_MAGIC)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("file \"%s\" is not an error snapshot", path)));
+    if (pq_getmsgint(&header, 4) != SNAPSHOT_VERSION)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("error snapshot \"%s\" has an unsupported version", path)));
+    flags = pq_getmsgint(&header, 4);
+    file_crc = pq_getmsgint(&header, 4);
+    raw_len = pq_getmsgint64(&header);
+    stored_len = pq_getmsgint64(&header);
+    num_records = pq_getmsgint64(&header);
+
+    if (stored_len != (uint64) st.st_size - SNAPSHOT_HEADER_SIZE ||
+        raw_len >= MaxAllocSize ||
+        (!(flags & SNAPSHOT_COMPRESSED) && raw_len != stored_len))
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("error snapshot \"%s\" is truncated", path)));
+
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, data + SNAPSHOT_HEADER_SIZE, stored_len);
+    FIN_CRC32C(crc);
+    if (!EQ_CRC32C(crc, file_crc))
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("error snapshot \"%s\" has a checksum mismatch", path)));
+
+    raw = data + SNAPSHOT_HEADER_SIZE;
+    if (flags & SNAPSHOT_COMPRESSED)
+    {
+        raw = palloc_extended(raw_len, MCXT_ALLOC_HUGE);
+        if (pglz_decompress(data + SNAPSHOT_HEADER_SIZE, stored_len, raw,
+                            raw_len, true) != (int32) raw_len)
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_CORRUPTED),
+                     errmsg("error snapshot \"%s\" could not be decompressed", path)));
+    }
+
+    /* Every record takes at least its length word */
+    if (num_records > raw_len / sizeof(uint32))
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("error snapshot \"%s\" is truncated", path)));
+
+    records = palloc_extended(sizeof(SnapshotRecord) * Max(num_records, 1),
+                              MCXT_ALLOC_HUGE);
+    initReadOnlyStringInfo(&body, raw, raw_len);
+    for (i = 0; i < num_records; i++)
+    {
+        ErrorRecord *error = &records[i].error;
+        StringInfoData record;
+        int len = pq_getmsgint(&body, 4);
+
+        initReadOnlyStringInfo(&record, (char *) pq_getmsgbytes(&body, len), len);
+        error->seq = pq_getmsgint64(&record);
+        error->backend_pid = pq_getmsgint(&record, 4);
+        pq_copymsgbytes(&record, error->sql_state, sizeof(error->sql_state));
+        error->sql_state[sizeof(error->sql_state) - 1] = '\0';
+        error->error_level = pq_getmsgint(&record, 4);
+        error->message_hash = pq_getmsgint64(&record);
+        error->queryid = pq_getmsgint64(&record);
+        error->timestamp = pq_getmsgint64(&record);
+        error->repeat_count = pq_getmsgint(&record, 4);
+        error->last_seen = pq_getmsgint64(&record);
+        records[i].node_name = snapshot_get_text(&record);
+        error->error_message = snapshot_get_text(&record);
+        error->query_text = snapshot_get_text(&record);
+        for (j = 0; j < ERROR_OBJECT_NAMES; j++)
+            error->object_names[j] = snapshot_get_text(&record);
+        error->from_previous_run = false;
+
+        if (records[i].node_name == NULL || error->error_message == NULL ||
+            error->query_text == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_CORRUPTED),
+                     errmsg("error snapshot \"%s\" has an invalid record", path)));
+    }
+
+    *count = num_records;
+    return records;
+}
+
+/*
+ * Read a length-prefixed string from a snapshot record
+ */
+static char *
+snapshot_get_text(StringInfo msg)
+{
+    uint32 len = pq_getmsgint(msg, 4);
+
+    if (len == SNAPSHOT_NULL_TEXT)
+        return NULL;
+    return pnstrdup(pq_getmsgbytes(msg, len), len);
+}
+
+/*
+ * qsort comparator identifying an error across snapshots: node, sequence
+ * number and timestamp
+ */
+static int
+snapshot_key_cmp(const void *a, const void *b)
+{
+    const SnapshotRecord *ra = (const SnapshotRecord *) a;
+    const SnapshotRecord *rb = (const SnapshotRecord *) b;
+    int cmp = strcmp(ra->node_name, rb->node_name);
+
+    if (cmp != 0)
+        return cmp;
+    if (ra->error.seq != rb->error.seq)
+        return ra->error.seq < rb->error.seq ? -1 : 1;
+    if (ra->error.timestamp != rb->error.timestamp)
+        return ra->error.timestamp < rb->error.timestamp ? -1 : 1;
+    return 0;
+}
+
+/*
+ * qsort comparator putting errors in time order, ties broken by node and
+ * sequence number
+ */
+static int
+snapshot_time_cmp(const void *a, const void *b)
+{
+    const SnapshotRecord *ra = (const SnapshotRecord *) a;
+    const SnapshotRecord *rb = (const SnapshotRecord *) b;
+
+    if (ra->error.timestamp != rb->error.timestamp)
+        return ra->error.timestamp < rb->error.timestamp ? -1 : 1;
+    return snapshot_key_cmp(a, b);
 }
@@ -0,0 +1,44 @@
+--
+-- Query normalization
+--
+CREATE EXTENSION pg_llm_helper;
+\set VERBOSITY sqlstate
+\pset tuples_only on
+\pset format unaligned
+
+-- Strings, with doubled quotes
+SELECT 'abc', 'it''s', 1/0;
+SELECT query_text FROM get_last_error();
+
+-- Prefixed strings
+SELECT E'a\'b', B'101', X'1F', N'n', 1/0;
+SELECT query_text FROM get_last_error();
+SELECT U&'d\0061t', u&'x', 1/0;
+SELECT query_text FROM get_last_error();
+
+-- Dollar-quoted strings
+SELECT $$it's$$, $q$a$$b$q$, 1/0;
+SELECT query_text FROM get_last_error();
+
+-- Comments are kept as they are
+SELECT /* 1 /* 2 */ 3 */ 4/0;
+SELECT query_text FROM get_last_error();
+SELECT 4/0 -- 5
+;
+SELECT query_text FROM get_last_error();
+
+-- Identifiers containing digits are not constants
+SELECT 1 AS c1, 2 AS a$1, 1/0;
+SELECT query_text FROM get_last_error();
+
+-- Constants are numbered after existing parameter symbols
+PREPARE p(int) AS SELECT 'new', $1, 2, nope;
+SELECT query_text FROM get_last_error();
+
+-- Numbers
+SELECT 1.5, .5, 1e3, 2.5E-3, 0x1F, 1_000, 1/0;
+SELECT query_text FROM get_last_error();
+
+-- Truncation does not split a multibyte character
+SELECT 1/0 AS "xéééééééééééééééééééééééééééééé";
+SELECT query_text FROM get_last_error();